@@ -28,11 +28,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <dotconf.h>
 
 #include "log.h"
 #include "configuration.h"
 #include "options.h"
+#include "connection.h"
+#include "normalize.h"
+#include "substitute.h"
 
 extern struct spd_options options;
 
@@ -40,27 +44,73 @@ extern struct spd_options options;
  * Declare the dotconf error handler and callbacks.
  */
 static FUNC_ERRORHANDLER(errorhandler);
+static DOTCONF_CB(cb_adaptiveRate);
+static DOTCONF_CB(cb_adaptiveRateMax);
+static DOTCONF_CB(cb_chunkSize);
+static DOTCONF_CB(cb_collapseSpaces);
 static DOTCONF_CB(cb_dontInitTables);
+static DOTCONF_CB(cb_echoPriority);
+static DOTCONF_CB(cb_floodBacklog);
+static DOTCONF_CB(cb_floodLimit);
+static DOTCONF_CB(cb_floodLines);
+static DOTCONF_CB(cb_floodPolicy);
+static DOTCONF_CB(cb_floodSummary);
+static DOTCONF_CB(cb_flushDelay);
+static DOTCONF_CB(cb_inlineProsody);
 static DOTCONF_CB(cb_language);
 static DOTCONF_CB(cb_logFile);
 static DOTCONF_CB(cb_logLevel);
+static DOTCONF_CB(cb_navigationDebounce);
+static DOTCONF_CB(cb_outageBuffer);
+static DOTCONF_CB(cb_repeatLimit);
+static DOTCONF_CB(cb_separateEcho);
+static DOTCONF_CB(cb_speakNewSuffix);
 static DOTCONF_CB(cb_speakupCharacters);
 static DOTCONF_CB(cb_speakupChartab);
 static DOTCONF_CB(cb_speakupCoding);
 static DOTCONF_CB(cb_speakupDevice);
+static DOTCONF_CB(cb_speechdBackend);
+static DOTCONF_CB(cb_stripCharacters);
+static DOTCONF_CB(cb_substitute);
+static DOTCONF_CB(cb_substituteWord);
+static DOTCONF_CB(cb_suppressRepeats);
+static DOTCONF_CB(cb_typingEcho);
 
 /*
  * Initialize the array of configuration options.
  */
 static const configoption_t configOptions[] = {
+	{"AdaptiveRate", ARG_INT, cb_adaptiveRate, NULL, CTX_ALL,},
+	{"AdaptiveRateMax", ARG_INT, cb_adaptiveRateMax, NULL, CTX_ALL,},
+	{"ChunkSize", ARG_INT, cb_chunkSize, NULL, CTX_ALL,},
+	{"CollapseSpaces", ARG_TOGGLE, cb_collapseSpaces, NULL, CTX_ALL,},
 	{"DontInitTables", ARG_TOGGLE, cb_dontInitTables, NULL, CTX_ALL,},
+	{"EchoPriority", ARG_STR, cb_echoPriority, NULL, CTX_ALL,},
+	{"FloodBacklog", ARG_INT, cb_floodBacklog, NULL, CTX_ALL,},
+	{"FloodLimit", ARG_INT, cb_floodLimit, NULL, CTX_ALL,},
+	{"FloodLines", ARG_INT, cb_floodLines, NULL, CTX_ALL,},
+	{"FloodPolicy", ARG_STR, cb_floodPolicy, NULL, CTX_ALL,},
+	{"FloodSummary", ARG_STR, cb_floodSummary, NULL, CTX_ALL,},
+	{"FlushDelay", ARG_INT, cb_flushDelay, NULL, CTX_ALL,},
+	{"InlineProsody", ARG_TOGGLE, cb_inlineProsody, NULL, CTX_ALL,},
 	{"Language", ARG_STR, cb_language, NULL, CTX_ALL,},
 	{"LogFile", ARG_STR, cb_logFile, NULL, CTX_ALL,},
 	{"LogLevel", ARG_INT, cb_logLevel, NULL, CTX_ALL,},
+	{"NavigationDebounce", ARG_INT, cb_navigationDebounce, NULL, CTX_ALL,},
+	{"OutageBuffer", ARG_INT, cb_outageBuffer, NULL, CTX_ALL,},
+	{"RepeatLimit", ARG_INT, cb_repeatLimit, NULL, CTX_ALL,},
+	{"SeparateEcho", ARG_TOGGLE, cb_separateEcho, NULL, CTX_ALL,},
+	{"SpeakNewSuffix", ARG_TOGGLE, cb_speakNewSuffix, NULL, CTX_ALL,},
 	{"SpeakupCharacters", ARG_STR, cb_speakupCharacters, NULL, CTX_ALL,},
 	{"SpeakupChartab", ARG_STR, cb_speakupChartab, NULL, CTX_ALL,},
 	{"SpeakupCoding", ARG_STR, cb_speakupCoding, NULL, CTX_ALL,},
 	{"SpeakupDevice", ARG_STR, cb_speakupDevice, NULL, CTX_ALL,},
+	{"SpeechdBackend", ARG_STR, cb_speechdBackend, NULL, CTX_ALL,},
+	{"StripCharacters", ARG_LIST, cb_stripCharacters, NULL, CTX_ALL,},
+	{"Substitute", ARG_LIST, cb_substitute, NULL, CTX_ALL,},
+	{"SubstituteWord", ARG_LIST, cb_substituteWord, NULL, CTX_ALL,},
+	{"SuppressRepeats", ARG_INT, cb_suppressRepeats, NULL, CTX_ALL,},
+	{"TypingEcho", ARG_STR, cb_typingEcho, NULL, CTX_ALL,},
 	LAST_OPTION
 };
 
@@ -70,6 +120,41 @@ static FUNC_ERRORHANDLER(errorhandler)
 	return 0;
 }
 
+static DOTCONF_CB(cb_adaptiveRate)
+{
+	if ((cmd->data.value < 0) || (cmd->data.value > 100))
+		FATAL(-1, "AdaptiveRate must be between 0 and 100");
+	LOG(3, "setting %s to %i\n", cmd->name, cmd->data.value);
+	options.adaptive_rate = cmd->data.value;
+	return NULL;
+}
+
+static DOTCONF_CB(cb_adaptiveRateMax)
+{
+	if ((cmd->data.value < 1) || (cmd->data.value > 200))
+		FATAL(-1, "AdaptiveRateMax must be between 1 and 200");
+	LOG(3, "setting %s to %i\n", cmd->name, cmd->data.value);
+	options.adaptive_rate_max = cmd->data.value;
+	return NULL;
+}
+
+static DOTCONF_CB(cb_chunkSize)
+{
+	if ((cmd->data.value != 0)
+	    && ((cmd->data.value < 10) || (cmd->data.value > 4096)))
+		FATAL(-1, "ChunkSize must be 0 or between 10 and 4096");
+	LOG(3, "setting %s to %i\n", cmd->name, cmd->data.value);
+	options.chunk_size = cmd->data.value;
+	return NULL;
+}
+
+static DOTCONF_CB(cb_collapseSpaces)
+{
+	LOG(3, "setting %s to %i\n", cmd->name, cmd->data.value);
+	options.collapse_spaces = cmd->data.value;
+	return NULL;
+}
+
 static DOTCONF_CB(cb_dontInitTables)
 {
 	if (options.dont_init_tables_set != COMMAND_LINE) {
@@ -81,6 +166,94 @@ static DOTCONF_CB(cb_dontInitTables)
 	return NULL;
 }
 
+static DOTCONF_CB(cb_echoPriority)
+{
+	assert(cmd->data.str);
+	if (conn_priority(cmd->data.str) == -1)
+		FATAL(-1, "EchoPriority must be one of important, message, "
+		      "text, notification or progress");
+	LOG(3, "setting %s to %s\n", cmd->name, cmd->data.str);
+	free(options.echo_priority);
+	options.echo_priority = strdup(cmd->data.str);
+	return NULL;
+}
+
+static DOTCONF_CB(cb_floodBacklog)
+{
+	if ((cmd->data.value < 1) || (cmd->data.value > CONN_MAX_SPEAKING / 2))
+		FATAL(-1, "FloodBacklog must be between 1 and %d",
+		      CONN_MAX_SPEAKING / 2);
+	LOG(3, "setting %s to %i\n", cmd->name, cmd->data.value);
+	options.flood_backlog = cmd->data.value;
+	return NULL;
+}
+
+static DOTCONF_CB(cb_floodLimit)
+{
+	if ((cmd->data.value < 2) || (cmd->data.value > 1024))
+		FATAL(-1, "FloodLimit must be between 2 and 1024");
+	LOG(3, "setting %s to %i\n", cmd->name, cmd->data.value);
+	options.flood_limit = cmd->data.value;
+	return NULL;
+}
+
+static DOTCONF_CB(cb_floodLines)
+{
+	if ((cmd->data.value < 1) || (cmd->data.value > 1024))
+		FATAL(-1, "FloodLines must be between 1 and 1024");
+	LOG(3, "setting %s to %i\n", cmd->name, cmd->data.value);
+	options.flood_lines = cmd->data.value;
+	return NULL;
+}
+
+static DOTCONF_CB(cb_floodPolicy)
+{
+	assert(cmd->data.str);
+	LOG(3, "setting %s to %s\n", cmd->name, cmd->data.str);
+	if (!strcasecmp(cmd->data.str, "none"))
+		options.flood_policy = FLOOD_NONE;
+	else if (!strcasecmp(cmd->data.str, "oldest"))
+		options.flood_policy = FLOOD_OLDEST;
+	else if (!strcasecmp(cmd->data.str, "last"))
+		options.flood_policy = FLOOD_LAST;
+	else if (!strcasecmp(cmd->data.str, "summary"))
+		options.flood_policy = FLOOD_SUMMARY;
+	else
+		FATAL(-1, "FloodPolicy must be none, oldest, last or summary");
+	return NULL;
+}
+
+static DOTCONF_CB(cb_floodSummary)
+{
+	const char *p;
+
+	/* It is used as a format, with the number of lines for %d */
+	assert(cmd->data.str);
+	p = strchr(cmd->data.str, '%');
+	if (p == NULL || p[1] != 'd' || strchr(p + 2, '%') != NULL)
+		FATAL(-1, "FloodSummary must contain %%d once and no other %%");
+	LOG(3, "setting %s to %s\n", cmd->name, cmd->data.str);
+	free(options.flood_summary);
+	options.flood_summary = strdup(cmd->data.str);
+	return NULL;
+}
+
+static DOTCONF_CB(cb_flushDelay)
+{
+	if ((cmd->data.value < 0) || (cmd->data.value > 1000))
+		FATAL(-1, "FlushDelay must be between 0 and 1000");
+	LOG(3, "setting %s to %i\n", cmd->name, cmd->data.value);
+	options.flush_delay = cmd->data.value;
+	return NULL;
+}
+
+static DOTCONF_CB(cb_inlineProsody)
+{
+	LOG(3, "setting %s to %i\n", cmd->name, cmd->data.value);
+	options.inline_prosody = cmd->data.value;
+	return NULL;
+}
+
 static DOTCONF_CB(cb_language)
 {
 	assert(cmd->data.str);
@@ -120,6 +293,48 @@ static DOTCONF_CB(cb_logLevel)
 	return NULL;
 }
 
+static DOTCONF_CB(cb_navigationDebounce)
+{
+	if ((cmd->data.value < 0) || (cmd->data.value > 1000))
+		FATAL(-1, "NavigationDebounce must be between 0 and 1000");
+	LOG(3, "setting %s to %i\n", cmd->name, cmd->data.value);
+	options.navigation_debounce = cmd->data.value;
+	return NULL;
+}
+
+static DOTCONF_CB(cb_outageBuffer)
+{
+	if ((cmd->data.value < 0) || (cmd->data.value > 1024))
+		FATAL(-1, "OutageBuffer must be between 0 and 1024");
+	LOG(3, "setting %s to %i\n", cmd->name, cmd->data.value);
+	options.outage_buffer = cmd->data.value;
+	return NULL;
+}
+
+static DOTCONF_CB(cb_repeatLimit)
+{
+	if ((cmd->data.value != 0)
+	    && ((cmd->data.value < 4) || (cmd->data.value > 1000)))
+		FATAL(-1, "RepeatLimit must be 0 or between 4 and 1000");
+	LOG(3, "setting %s to %i\n", cmd->name, cmd->data.value);
+	options.repeat_limit = cmd->data.value;
+	return NULL;
+}
+
+static DOTCONF_CB(cb_separateEcho)
+{
+	LOG(3, "setting %s to %i\n", cmd->name, cmd->data.value);
+	options.separate_echo = cmd->data.value;
+	return NULL;
+}
+
+static DOTCONF_CB(cb_speakNewSuffix)
+{
+	LOG(3, "setting %s to %i\n", cmd->name, cmd->data.value);
+	options.speak_new_suffix = cmd->data.value;
+	return NULL;
+}
+
 static DOTCONF_CB(cb_speakupCharacters)
 {
 	assert(cmd->data.str);
@@ -172,6 +387,79 @@ static DOTCONF_CB(cb_speakupDevice)
 	return NULL;
 }
 
+static DOTCONF_CB(cb_speechdBackend)
+{
+	assert(cmd->data.str);
+	LOG(3, "setting %s to %s\n", cmd->name, cmd->data.str);
+	if (!strcasecmp(cmd->data.str, "libspeechd"))
+		options.speechd_backend = BACKEND_LIBSPEECHD;
+	else if (!strcasecmp(cmd->data.str, "native"))
+		options.speechd_backend = BACKEND_NATIVE;
+	else
+		FATAL(-1, "SpeechdBackend must be libspeechd or native");
+	return NULL;
+}
+
+static DOTCONF_CB(cb_stripCharacters)
+{
+	int i, class;
+
+	options.strip_classes = 0;
+	for (i = 0; i < cmd->arg_count; i++) {
+		class = normalize_class(cmd->data.list[i]);
+		if (class == -1)
+			FATAL(-1, "StripCharacters knows control, punctuation, "
+			      "box and block, not %s", cmd->data.list[i]);
+		LOG(3, "%s: stripping %s\n", cmd->name, cmd->data.list[i]);
+		options.strip_classes |= class;
+	}
+	return NULL;
+}
+
+static DOTCONF_CB(cb_substitute)
+{
+	if (cmd->arg_count != 2 || cmd->data.list[0][0] == 0)
+		FATAL(-1, "Substitute needs a string and its replacement");
+	LOG(3, "%s: \"%s\" by \"%s\"\n", cmd->name, cmd->data.list[0],
+	    cmd->data.list[1]);
+	substitute_add(cmd->data.list[0], cmd->data.list[1], 0);
+	return NULL;
+}
+
+static DOTCONF_CB(cb_substituteWord)
+{
+	if (cmd->arg_count != 2 || cmd->data.list[0][0] == 0)
+		FATAL(-1, "SubstituteWord needs a word and its replacement");
+	LOG(3, "%s: \"%s\" by \"%s\"\n", cmd->name, cmd->data.list[0],
+	    cmd->data.list[1]);
+	substitute_add(cmd->data.list[0], cmd->data.list[1], 1);
+	return NULL;
+}
+
+static DOTCONF_CB(cb_suppressRepeats)
+{
+	if ((cmd->data.value < 0) || (cmd->data.value > 600000))
+		FATAL(-1, "SuppressRepeats must be between 0 and 600000");
+	LOG(3, "setting %s to %i\n", cmd->name, cmd->data.value);
+	options.suppress_repeats = cmd->data.value;
+	return NULL;
+}
+
+static DOTCONF_CB(cb_typingEcho)
+{
+	assert(cmd->data.str);
+	LOG(3, "setting %s to %s\n", cmd->name, cmd->data.str);
+	if (!strcasecmp(cmd->data.str, "characters"))
+		options.typing_echo = ECHO_CHARACTERS;
+	else if (!strcasecmp(cmd->data.str, "words"))
+		options.typing_echo = ECHO_WORDS;
+	else if (!strcasecmp(cmd->data.str, "both"))
+		options.typing_echo = ECHO_BOTH;
+	else
+		FATAL(-1, "TypingEcho must be characters, words or both");
+	return NULL;
+}
+
 void load_configuration(void)
 {
 	configfile_t *configfile;
@@ -186,6 +474,12 @@ void load_configuration(void)
 	if (dotconf_command_loop(configfile) == 0)
 		FATAL(-1, "Error reading config file\n");
 	dotconf_cleanup(configfile);
+	if (options.flood_lines > options.flood_limit) {
+		LOG(1, "FloodLines can't be more than FloodLimit, using %d",
+		    options.flood_limit);
+		options.flood_lines = options.flood_limit;
+	}
+	substitute_compile();
 	LOG(1, "Configuration has been read from \"%s\"",
 	    options.config_file_name);
 }
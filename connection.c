@@ -0,0 +1,532 @@
+/*
+ * connection.c - Connection to Speech Dispatcher
+ *
+ * Copyright (C) 2004, 2006, 2007 Brailcom, o.p.s.
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+
+#include "log.h"
+#include "options.h"
+#include "connection.h"
+
+extern struct spd_options options;
+
+const struct voice_state voice_unset = {
+	VOICE_UNSET, VOICE_UNSET, VOICE_UNSET, VOICE_UNSET
+};
+
+/* SSIP names of the libspeechd constants */
+static const char *priority_names[] = {
+	[SPD_IMPORTANT] = "important",
+	[SPD_MESSAGE] = "message",
+	[SPD_TEXT] = "text",
+	[SPD_NOTIFICATION] = "notification",
+	[SPD_PROGRESS] = "progress",
+};
+
+static const char *punctuation_names[] = {
+	[SPD_PUNCT_ALL] = "all",
+	[SPD_PUNCT_NONE] = "none",
+	[SPD_PUNCT_SOME] = "some",
+};
+
+static const char *voice_type_names[] = {
+	[SPD_MALE1] = "male1",
+	[SPD_MALE2] = "male2",
+	[SPD_MALE3] = "male3",
+	[SPD_FEMALE1] = "female1",
+	[SPD_FEMALE2] = "female2",
+	[SPD_FEMALE3] = "female3",
+	[SPD_CHILD_MALE] = "child_male",
+	[SPD_CHILD_FEMALE] = "child_female",
+};
+
+/* libspeechd callbacks don't know which connection they belong to, so
+   there is a single receiver for the events of all of them. */
+static ssip_event_cb event_callback;
+
+/* The open connections, whose messages are looked up by their id when
+   they end. libspeechd reports events in a thread of its own. */
+static struct connection *connections;
+static pthread_mutex_t speaking_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* libspeechd's thread goes on reading events while spd_say() returns
+   the id of a message, so a short message may end before it is added.
+   The ids which ended unknown are kept here for speaking_add(). */
+#define ENDED_EARLY 16
+static size_t ended_early[ENDED_EARLY];
+static int n_ended_early;
+static int next_ended_early;
+
+/* The native client only reports anything from conn_process(), this
+   is the connection being processed there. */
+static struct connection *processing;
+
+static void speaking_add(struct connection *conn, size_t msg_id)
+{
+	int i;
+
+	pthread_mutex_lock(&speaking_lock);
+	for (i = 0; i < n_ended_early; i++)
+		if (ended_early[i] == msg_id) {
+			ended_early[i] = 0;
+			pthread_mutex_unlock(&speaking_lock);
+			return;
+		}
+	if (conn->n_speaking < CONN_MAX_SPEAKING)
+		conn->speaking[conn->n_speaking++] = msg_id;
+	else
+		conn->speaking_overflow = 1;
+	pthread_mutex_unlock(&speaking_lock);
+}
+
+/* A message whose id is not known can't be tracked */
+static void speaking_add_unknown(struct connection *conn)
+{
+	pthread_mutex_lock(&speaking_lock);
+	conn->speaking_overflow = 1;
+	pthread_mutex_unlock(&speaking_lock);
+}
+
+static void speaking_remove(size_t msg_id)
+{
+	struct connection *conn;
+	int i;
+
+	pthread_mutex_lock(&speaking_lock);
+	for (conn = connections; conn != NULL; conn = conn->next)
+		for (i = 0; i < conn->n_speaking; i++)
+			if (conn->speaking[i] == msg_id) {
+				conn->speaking[i] =
+				    conn->speaking[--conn->n_speaking];
+				goto out;
+			}
+
+	/* Not added yet, or not ours at all; the oldest one is replaced */
+	ended_early[next_ended_early] = msg_id;
+	next_ended_early = (next_ended_early + 1) % ENDED_EARLY;
+	if (n_ended_early < ENDED_EARLY)
+		n_ended_early++;
+ out:
+	pthread_mutex_unlock(&speaking_lock);
+}
+
+static void conn_event(enum ssip_event event, size_t msg_id,
+		       const char *mark)
+{
+	if (event == SSIP_QUEUED) {
+		if (processing != NULL) {
+			processing->unconfirmed--;
+			if (msg_id != 0)
+				speaking_add(processing, msg_id);
+		}
+		return;
+	}
+	if (event == SSIP_END || event == SSIP_CANCEL)
+		speaking_remove(msg_id);
+	if (event_callback != NULL)
+		event_callback(event, msg_id, mark);
+}
+
+static void spd_index_mark(size_t msg_id, size_t client_id,
+			   SPDNotificationType type, char *index_mark)
+{
+	conn_event(SSIP_INDEX_MARK, msg_id, index_mark);
+}
+
+static void spd_end(size_t msg_id, size_t client_id,
+		    SPDNotificationType type)
+{
+	conn_event((type == SPD_EVENT_CANCEL) ? SSIP_CANCEL : SSIP_END,
+		   msg_id, NULL);
+}
+
+static int spd_backend_open(struct connection *conn)
+{
+	conn->spd = spd_open("speakup", conn->name, "test",
+			     SPD_MODE_THREADED);
+	if (conn->spd == NULL)
+		return -1;
+
+	conn->spd->callback_im = spd_index_mark;
+	if (spd_set_notification_on(conn->spd, SPD_INDEX_MARKS) == -1)
+		LOG(1, "Error turning on Index Mark Callback");
+
+	conn->spd->callback_end = spd_end;
+	conn->spd->callback_cancel = spd_end;
+	if (spd_set_notification_on(conn->spd, SPD_END) == -1
+	    || spd_set_notification_on(conn->spd, SPD_CANCEL) == -1)
+		LOG(1, "Error turning on End and Cancel Callbacks");
+
+	if (options.language_set != DEFAULT)
+		if (spd_set_language(conn->spd, options.language) == -1)
+			LOG(1, "Error setting language");
+
+	if (spd_set_capital_letters(conn->spd, SPD_CAP_NONE) == -1)
+		LOG(1, "Unable to set capital letter recognition");
+
+	if (spd_set_data_mode(conn->spd, SPD_DATA_SSML)) {
+		LOG(1,
+		    "ERROR: This version of Speech Dispatcher doesn't support SSML mode.\n"
+		    "Please use a newer version of Speech Dispatcher (at least 0.5)");
+		FATAL(6, "SSML not supported in Speech Dispatcher");
+	}
+	return 0;
+}
+
+/* The native client doesn't wait for replies, so failures of these
+   commands only show up in the log. */
+static int ssip_backend_open(struct connection *conn)
+{
+	char client_name[64];
+
+	snprintf(client_name, sizeof(client_name), "test:speakup:%s",
+		 conn->name);
+	conn->ssip = ssip_open(client_name, conn_event);
+	if (conn->ssip == NULL)
+		return -1;
+
+	ssip_command(conn->ssip, "SET SELF NOTIFICATION index_marks on");
+	ssip_command(conn->ssip, "SET SELF NOTIFICATION end on");
+	ssip_command(conn->ssip, "SET SELF NOTIFICATION cancel on");
+	if (options.language_set != DEFAULT)
+		ssip_command(conn->ssip, "SET SELF LANGUAGE %s",
+			     options.language);
+	ssip_command(conn->ssip, "SET SELF CAP_LET_RECOGN none");
+	ssip_command(conn->ssip, "SET SELF SSML_MODE on");
+	return 0;
+}
+
+/*
+  conn_open: connect to Speech Dispatcher and set it up for Speakup.
+  Returns -1 if the server can't be reached. */
+
+int conn_open(struct connection *conn, const char *name,
+	      ssip_event_cb callback)
+{
+	int ret;
+
+	conn->name = name;
+	conn->spd = NULL;
+	conn->ssip = NULL;
+	conn->voice = voice_unset;
+	conn->priority = VOICE_UNSET;
+	conn->n_speaking = 0;
+	conn->speaking_overflow = 0;
+	conn->unconfirmed = 0;
+
+	pthread_mutex_lock(&speaking_lock);
+	conn->next = connections;
+	connections = conn;
+	pthread_mutex_unlock(&speaking_lock);
+
+	event_callback = callback;
+	if (options.speechd_backend == BACKEND_NATIVE)
+		ret = ssip_backend_open(conn);
+	else
+		ret = spd_backend_open(conn);
+	if (ret == 0)
+		LOG(4, "Connection %s to Speech Dispatcher opened", name);
+	else
+		conn_close(conn);
+	return ret;
+}
+
+void conn_close(struct connection *conn)
+{
+	struct connection **p;
+
+	pthread_mutex_lock(&speaking_lock);
+	for (p = &connections; *p != NULL; p = &(*p)->next)
+		if (*p == conn) {
+			*p = conn->next;
+			break;
+		}
+	pthread_mutex_unlock(&speaking_lock);
+
+	if (conn->spd != NULL)
+		spd_close(conn->spd);
+	if (conn->ssip != NULL)
+		ssip_close(conn->ssip);
+	conn->spd = NULL;
+	conn->ssip = NULL;
+}
+
+/*
+  conn_swap: exchange two open connections, e.g. to put one opened
+  ahead in the place of the one in use. */
+
+void conn_swap(struct connection *a, struct connection *b)
+{
+	struct connection tmp;
+	struct connection *a_next = a->next, *b_next = b->next;
+
+	/* The list of connections stays as it is */
+	pthread_mutex_lock(&speaking_lock);
+	tmp = *a;
+	*a = *b;
+	*b = tmp;
+	a->next = a_next;
+	b->next = b_next;
+	pthread_mutex_unlock(&speaking_lock);
+}
+
+/*
+  conn_sync_voice: bring the voice settings of Speech Dispatcher up to
+  date with what Speakup asked for. Only the settings which really
+  changed since they were last sent are sent. */
+
+void conn_sync_voice(struct connection *conn,
+		     const struct voice_state *wanted)
+{
+	int ret;
+
+	if (wanted->punctuation != VOICE_UNSET
+	    && wanted->punctuation != conn->voice.punctuation) {
+		if (conn->ssip != NULL)
+			ret = ssip_command(conn->ssip,
+					   "SET SELF PUNCTUATION %s",
+					   punctuation_names[wanted->
+							     punctuation]);
+		else
+			ret = spd_set_punctuation(conn->spd,
+						  wanted->punctuation);
+		if (ret == -1)
+			LOG(1, "ERROR: Can't set punctuation mode");
+		else
+			conn->voice.punctuation = wanted->punctuation;
+	}
+
+	if (wanted->voice_type != VOICE_UNSET
+	    && wanted->voice_type != conn->voice.voice_type) {
+		if (conn->ssip != NULL)
+			ret = ssip_command(conn->ssip, "SET SELF VOICE_TYPE %s",
+					   voice_type_names[wanted->
+							    voice_type]);
+		else
+			ret = spd_set_voice_type(conn->spd,
+						 wanted->voice_type);
+		if (ret == -1)
+			LOG(1, "ERROR: Can't set voice!");
+		else
+			conn->voice.voice_type = wanted->voice_type;
+	}
+
+	if (wanted->pitch != VOICE_UNSET && wanted->pitch != conn->voice.pitch) {
+		if (conn->ssip != NULL)
+			ret = ssip_command(conn->ssip, "SET SELF PITCH %d",
+					   wanted->pitch);
+		else
+			ret = spd_set_voice_pitch(conn->spd, wanted->pitch);
+		if (ret == -1)
+			LOG(1, "ERROR: Can't set pitch!");
+		else
+			conn->voice.pitch = wanted->pitch;
+	}
+
+	if (wanted->rate != VOICE_UNSET && wanted->rate != conn->voice.rate) {
+		if (conn->ssip != NULL)
+			ret = ssip_command(conn->ssip, "SET SELF RATE %d",
+					   wanted->rate);
+		else
+			ret = spd_set_voice_rate(conn->spd, wanted->rate);
+		if (ret == -1)
+			LOG(1, "ERROR: Invalid rate!");
+		else
+			conn->voice.rate = wanted->rate;
+	}
+}
+
+static int set_priority(struct connection *conn, SPDPriority priority)
+{
+	char cmd[32];
+	int ret;
+
+	if (conn->priority == priority)
+		return 0;
+
+	snprintf(cmd, sizeof(cmd), "SET SELF PRIORITY %s",
+		 priority_names[priority]);
+	if (conn->ssip != NULL)
+		ret = ssip_command(conn->ssip, "%s", cmd);
+	else
+		ret = spd_execute_command(conn->spd, cmd);
+	if (ret != 0)
+		return ret;
+	conn->priority = priority;
+	return 0;
+}
+
+/*
+  conn_say: send an SSML message. */
+
+int conn_say(struct connection *conn, SPDPriority priority,
+	     const char *ssml)
+{
+	int msg_id;
+
+	if (conn->ssip != NULL) {
+		if (set_priority(conn, priority))
+			return -1;
+		conn->unconfirmed++;
+		return ssip_speak(conn->ssip, ssml);
+	}
+
+	/* spd_say() always sets the priority itself */
+	conn->priority = priority;
+	msg_id = spd_say(conn->spd, priority, ssml);
+	if (msg_id == -1)
+		return -1;
+	speaking_add(conn, msg_id);
+	return 0;
+}
+
+/*
+  conn_char: say a single character with the SSIP CHAR command. */
+
+int conn_char(struct connection *conn, SPDPriority priority,
+	      const char *character)
+{
+	char cmd[16];
+	char *reply = NULL;
+	int ret;
+
+	ret = set_priority(conn, priority);
+	if (ret != 0)
+		return ret;
+
+	if (conn->ssip != NULL) {
+		conn->unconfirmed++;
+		return ssip_command(conn->ssip, "CHAR %s", character);
+	}
+
+	/* It seems there is a bug in some versions of libspeechd
+	   in function spd_say_char() */
+	snprintf(cmd, 12, "CHAR %s", character);
+	ret = spd_execute_command_with_reply(conn->spd, cmd, &reply);
+	if (ret == 0) {
+		/* The reply starts with the message id: 225-<id> */
+		if (reply != NULL && !strncmp(reply, "225-", 4))
+			speaking_add(conn, strtoul(reply + 4, NULL, 10));
+		else
+			speaking_add_unknown(conn);
+	}
+	free(reply);
+	return ret;
+}
+
+int conn_cancel(struct connection *conn)
+{
+	pthread_mutex_lock(&speaking_lock);
+	conn->n_speaking = 0;
+	conn->speaking_overflow = 0;
+	pthread_mutex_unlock(&speaking_lock);
+
+	if (conn->ssip != NULL)
+		return ssip_command(conn->ssip, "CANCEL SELF");
+	return spd_cancel(conn->spd);
+}
+
+/*
+  conn_idle: tell whether none of the messages sent on the connection
+  can still be speaking, so that a cancel would do nothing. With the
+  native client, a message whose reply hasn't arrived yet counts as
+  speaking. */
+
+int conn_idle(struct connection *conn)
+{
+	int idle;
+
+	pthread_mutex_lock(&speaking_lock);
+	idle = (conn->n_speaking == 0 && !conn->speaking_overflow);
+	pthread_mutex_unlock(&speaking_lock);
+
+	if (conn->ssip != NULL && ssip_waiting(conn->ssip))
+		idle = 0;
+	return idle;
+}
+
+/*
+  conn_backlog: the number of messages sent on the connection which
+  haven't ended yet, as far as they can be tracked. */
+
+int conn_backlog(struct connection *conn)
+{
+	int backlog;
+
+	pthread_mutex_lock(&speaking_lock);
+	backlog = conn->n_speaking + conn->unconfirmed;
+	pthread_mutex_unlock(&speaking_lock);
+	return backlog;
+}
+
+/*
+  conn_fd: the socket the main loop must watch for this connection, or
+  -1 if libspeechd watches it in its own thread. */
+
+int conn_fd(const struct connection *conn)
+{
+	if (conn->ssip != NULL)
+		return ssip_fd(conn->ssip);
+	return -1;
+}
+
+int conn_want_write(const struct connection *conn)
+{
+	if (conn->ssip != NULL)
+		return ssip_want_write(conn->ssip);
+	return 0;
+}
+
+/*
+  conn_process: handle traffic on the socket returned by conn_fd(). */
+
+int conn_process(struct connection *conn)
+{
+	int ret;
+
+	if (conn->ssip == NULL)
+		return 0;
+	processing = conn;
+	ret = ssip_process(conn->ssip);
+	processing = NULL;
+	return ret;
+}
+
+/*
+  conn_priority: return the priority called name, or -1 if there is no
+  such priority. */
+
+int conn_priority(const char *name)
+{
+	int i;
+
+	for (i = SPD_IMPORTANT; i <= SPD_PROGRESS; i++)
+		if (!strcasecmp(name, priority_names[i]))
+			return i;
+	return -1;
+}
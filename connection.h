@@ -0,0 +1,82 @@
+/*
+ * connection.h - Connection to Speech Dispatcher
+ *
+ * Copyright (C) 2004, 2006, 2007 Brailcom, o.p.s.
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#include <limits.h>
+#include <libspeechd.h>
+
+#include "ssip.h"
+
+/* VOICE_UNSET means a setting is not known */
+#define VOICE_UNSET INT_MIN
+
+struct voice_state {
+	int rate;
+	int pitch;
+	int punctuation;
+	int voice_type;
+};
+
+extern const struct voice_state voice_unset;
+
+/* Most messages tracked until they end, see conn_idle() */
+#define CONN_MAX_SPEAKING 64
+
+/* A connection goes either through libspeechd or through our own
+   pipelined SSIP client, see the SpeechdBackend option. */
+struct connection {
+	const char *name;
+	SPDConnection *spd;
+	struct ssip *ssip;
+	struct voice_state voice;	/* Settings as last sent */
+	int priority;		/* Priority as last set */
+
+	/* Messages sent which haven't ended or been cancelled yet. If
+	   there are too many, speaking_overflow is set and the connection
+	   counts as busy until the next cancel. */
+	size_t speaking[CONN_MAX_SPEAKING];
+	int n_speaking;
+	int speaking_overflow;
+	int unconfirmed;	/* Sent by the native client, id unknown yet */
+	struct connection *next;	/* In the list of open connections */
+};
+
+int conn_open(struct connection *conn, const char *name,
+	      ssip_event_cb callback);
+void conn_close(struct connection *conn);
+void conn_swap(struct connection *a, struct connection *b);
+void conn_sync_voice(struct connection *conn,
+		     const struct voice_state *wanted);
+int conn_say(struct connection *conn, SPDPriority priority,
+	     const char *ssml);
+int conn_char(struct connection *conn, SPDPriority priority,
+	      const char *character);
+int conn_cancel(struct connection *conn);
+int conn_idle(struct connection *conn);
+int conn_backlog(struct connection *conn);
+int conn_fd(const struct connection *conn);
+int conn_want_write(const struct connection *conn);
+int conn_process(struct connection *conn);
+int conn_priority(const char *name);
+
+#endif
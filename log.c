@@ -45,23 +45,24 @@ void LOG(int level, char *format, ...)
 		int i;
 
 		va_start(args, format);
+		/* Both threads log, keep their lines whole */
+		flockfile(logfile);
 		{
 			{
 				/* Print timestamp */
 				time_t t;
-				char *tstr;
+				char tstr[32];
 				t = time(NULL);
-				tstr = (char *)strdup((char *)ctime(&t));
-				if (tstr == NULL) {
-					fprintf(stderr,
-						"strdup(ctime) failed, can't log");
+				if (ctime_r(&t, tstr) == NULL) {
+					fprintf(stderr, "ctime failed, can't log");
+					funlockfile(logfile);
+					va_end(args);
 					return;
 				}
 				/* Remove the trailing \n */
 				assert(strlen(tstr) > 1);
 				tstr[strlen(tstr) - 1] = 0;
 				fprintf(logfile, "[%s] speechd: ", tstr);
-				free(tstr);
 			}
 			for (i = 1; i < level; i++) {
 				fprintf(logfile, " ");
@@ -70,6 +71,7 @@ void LOG(int level, char *format, ...)
 			fprintf(logfile, "\n");
 			fflush(logfile);
 		}
+		funlockfile(logfile);
 		va_end(args);
 	}
 }
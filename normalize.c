@@ -0,0 +1,203 @@
+/*
+ * normalize.c - Cleaning up console text before it is said
+ *
+ * Copyright (C) 2004, 2006, 2007 Brailcom, o.p.s.
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * The text is rewritten in place in one pass. Every piece of output is
+ * at most as long as the input it replaces, so writing never overtakes
+ * reading. Index marks and prosody changes are copied as they are.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#include "options.h"
+#include "recode.h"
+#include "normalize.h"
+
+extern struct spd_options options;
+
+static const struct {
+	const char *name;
+	int class;
+} class_names[] = {
+	{"control", STRIP_CONTROL},
+	{"punctuation", STRIP_PUNCTUATION},
+	{"box", STRIP_BOX},
+	{"block", STRIP_BLOCK},
+};
+
+/*
+  normalize_class: return the STRIP_ constant for a class name, or -1
+  if there is no such class. */
+
+int normalize_class(const char *name)
+{
+	int i;
+
+	for (i = 0; i < sizeof(class_names) / sizeof(class_names[0]); i++)
+		if (!strcasecmp(name, class_names[i].name))
+			return class_names[i].class;
+	return -1;
+}
+
+int normalize_enabled(void)
+{
+	return options.collapse_spaces || options.repeat_limit > 0
+	    || options.strip_classes != 0;
+}
+
+/* Length of the character at p, trusting the lead byte of UTF-8 */
+static size_t char_len(const unsigned char *p, size_t left, int utf8)
+{
+	size_t len = 1;
+
+	if (utf8 && p[0] >= 0xc0) {
+		if (p[0] < 0xe0)
+			len = 2;
+		else if (p[0] < 0xf0)
+			len = 3;
+		else
+			len = 4;
+	}
+	return (len <= left) ? len : 1;
+}
+
+static int stripped(const unsigned char *p, size_t len)
+{
+	int class = options.strip_classes;
+	unsigned int code;
+	const char *utf8;
+
+	if (len == 1) {
+		if ((class & STRIP_CONTROL) && p[0] < 0x20 && p[0] != '\t'
+		    && p[0] != '\n' && p[0] != RECODE_MARK)
+			return 1;
+		if ((class & STRIP_PUNCTUATION) && ispunct(p[0]))
+			return 1;
+		/* Box and block characters of a unibyte encoding are
+		   known by their UTF-8 form */
+		if (p[0] < 0x80 || !(class & (STRIP_BOX | STRIP_BLOCK))
+		    || (utf8 = recode_byte(p[0])) == NULL)
+			return 0;
+		p = (const unsigned char *)utf8;
+		len = strlen(utf8);
+	}
+
+	if (len != 3 || p[0] != 0xe2)
+		return 0;
+	code = ((p[0] & 0x0f) << 12) | ((p[1] & 0x3f) << 6) | (p[2] & 0x3f);
+	if ((class & STRIP_BOX) && code >= 0x2500 && code <= 0x257f)
+		return 1;
+	if ((class & STRIP_BLOCK) && code >= 0x2580 && code <= 0x259f)
+		return 1;
+	return 0;
+}
+
+static int is_space(const unsigned char *p, size_t len)
+{
+	return (len == 1 && isspace(p[0])) || stripped(p, len);
+}
+
+/*
+  normalize: collapse white space, replace long runs of a repeated
+  symbol by their count and the symbol, and turn characters of the
+  classes in StripCharacters into spaces, according to the options.
+  Returns the new length of text. */
+
+size_t normalize(char *text, size_t len, int utf8)
+{
+	unsigned char *s = (unsigned char *)text;
+	size_t r = 0, w = 0, n, start, count;
+	int newline;
+	char phrase[32];
+	unsigned char symbol[4];
+
+	while (r < len) {
+		/* Copy marks whole */
+		if (s[r] == RECODE_MARK) {
+			s[w++] = s[r++];
+			while (r < len && (isdigit(s[r]) || s[r] == '-'))
+				s[w++] = s[r++];
+			if (r < len)
+				s[w++] = s[r++];
+			continue;
+		}
+
+		n = char_len(s + r, len - r, utf8);
+
+		if (is_space(s + r, n)) {
+			if (!options.collapse_spaces) {
+				s[w++] = stripped(s + r, n) ? ' ' : s[r];
+				r += n;
+				continue;
+			}
+			/* Keep a single space, or a new line if there is
+			   one in the run */
+			newline = 0;
+			while (r < len && is_space(s + r, n)) {
+				if (s[r] == '\n')
+					newline = 1;
+				r += n;
+				if (r < len)
+					n = char_len(s + r, len - r, utf8);
+			}
+			s[w++] = newline ? '\n' : ' ';
+			continue;
+		}
+
+		if (options.repeat_limit > 0 && !(n == 1 && isalnum(s[r]))) {
+			start = r;
+			count = 0;
+			while (r + n <= len && !memcmp(s + r, s + start, n)) {
+				count++;
+				r += n;
+			}
+			if (count > options.repeat_limit) {
+				/* The phrase may overwrite the run */
+				memcpy(symbol, s + start, n);
+				snprintf(phrase, sizeof(phrase), "%s%d ",
+					 (w == 0 || isspace(s[w - 1])) ? "" : " ",
+					 (int)count);
+				memcpy(s + w, phrase, strlen(phrase));
+				w += strlen(phrase);
+				memcpy(s + w, symbol, n);
+				w += n;
+				if (r < len && !isspace(s[r]))
+					s[w++] = ' ';
+			} else {
+				memmove(s + w, s + start, r - start);
+				w += r - start;
+			}
+			continue;
+		}
+
+		memmove(s + w, s + r, n);
+		w += n;
+		r += n;
+	}
+	return w;
+}
@@ -0,0 +1,37 @@
+/*
+ * normalize.h - Cleaning up console text before it is said
+ *
+ * Copyright (C) 2004, 2006, 2007 Brailcom, o.p.s.
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef NORMALIZE_H
+#define NORMALIZE_H
+
+#include <stddef.h>
+
+/* Classes of characters for StripCharacters */
+#define STRIP_CONTROL 1		/* Control characters but tab and newline */
+#define STRIP_PUNCTUATION 2	/* ASCII punctuation and symbols */
+#define STRIP_BOX 4		/* Box drawing, U+2500 to U+257F */
+#define STRIP_BLOCK 8		/* Block elements, U+2580 to U+259F */
+
+int normalize_class(const char *name);
+int normalize_enabled(void);
+size_t normalize(char *text, size_t len, int utf8);
+
+#endif
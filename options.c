@@ -124,6 +124,27 @@ void options_set_default(void)
 	options.probe_mode = 0;
 	options.dont_init_tables = 0;
 	options.dont_init_tables_set = DEFAULT;
+	options.inline_prosody = 0;
+	options.echo_priority = strdup("text");
+	options.speechd_backend = BACKEND_LIBSPEECHD;
+	options.separate_echo = 0;
+	options.flush_delay = 5;
+	options.navigation_debounce = 0;
+	options.typing_echo = ECHO_CHARACTERS;
+	options.flood_policy = FLOOD_NONE;
+	options.flood_backlog = 4;
+	options.flood_limit = 32;
+	options.flood_lines = 3;
+	options.flood_summary = strdup("%d lines skipped.");
+	options.adaptive_rate = 0;
+	options.adaptive_rate_max = 50;
+	options.chunk_size = 0;
+	options.collapse_spaces = 0;
+	options.repeat_limit = 0;
+	options.strip_classes = 0;
+	options.suppress_repeats = 0;
+	options.speak_new_suffix = 0;
+	options.outage_buffer = 16;
 }
 
 void options_parse(int argc, char *argv[])
@@ -25,6 +25,18 @@
 #define MODE_DAEMON 1
 #define MODE_SINGLE 0
 
+#define BACKEND_LIBSPEECHD 0
+#define BACKEND_NATIVE 1
+
+#define ECHO_CHARACTERS 0
+#define ECHO_WORDS 1
+#define ECHO_BOTH 2
+
+#define FLOOD_NONE 0
+#define FLOOD_OLDEST 1
+#define FLOOD_LAST 2
+#define FLOOD_SUMMARY 3
+
 #define DEFAULT 0
 #define COMMAND_LINE 1
 #define CONFIG_FILE 2
@@ -49,6 +61,27 @@ struct spd_options {
 	int probe_mode;
 	int dont_init_tables;
 	int dont_init_tables_set;
+	int inline_prosody;
+	char *echo_priority;
+	int speechd_backend;
+	int separate_echo;
+	int flush_delay;
+	int navigation_debounce;
+	int typing_echo;
+	int flood_policy;
+	int flood_backlog;
+	int flood_limit;
+	int flood_lines;
+	char *flood_summary;
+	int adaptive_rate;
+	int adaptive_rate_max;
+	int chunk_size;
+	int collapse_spaces;
+	int repeat_limit;
+	int strip_classes;
+	int suppress_repeats;
+	int speak_new_suffix;
+	int outage_buffer;
 };
 
 void options_set_default(void);
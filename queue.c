@@ -0,0 +1,86 @@
+/*
+ * queue.c - Queue of parsed events between the reader and the dispatcher
+ *
+ * Copyright (C) 2004, 2006, 2007 Brailcom, o.p.s.
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * The producer only ever writes tail and the consumer only ever writes
+ * head, so no lock is needed: an event is stored before tail is
+ * released past it, and read before head is released past it.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <assert.h>
+
+#include "queue.h"
+
+int queue_init(struct queue *queue, size_t size)
+{
+	assert(size > 0 && (size & (size - 1)) == 0);
+	queue->events = calloc(size, sizeof(struct event));
+	if (queue->events == NULL)
+		return -1;
+	queue->size = size;
+	queue->head = 0;
+	queue->tail = 0;
+	return 0;
+}
+
+void queue_free(struct queue *queue)
+{
+	free(queue->events);
+	queue->events = NULL;
+	queue->size = 0;
+}
+
+/*
+  queue_push: add an event, from the producer thread only. Returns -1
+  if the queue is full. */
+
+int queue_push(struct queue *queue, const struct event *event)
+{
+	size_t tail = queue->tail;
+	size_t head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+
+	if (tail - head == queue->size)
+		return -1;
+	queue->events[tail & (queue->size - 1)] = *event;
+	__atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/*
+  queue_pop: take the oldest event, from the consumer thread only.
+  Returns -1 if the queue is empty. */
+
+int queue_pop(struct queue *queue, struct event *event)
+{
+	size_t head = queue->head;
+	size_t tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+
+	if (head == tail)
+		return -1;
+	*event = queue->events[head & (queue->size - 1)];
+	__atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+	return 0;
+}
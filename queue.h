@@ -0,0 +1,55 @@
+/*
+ * queue.h - Queue of parsed events between the reader and the dispatcher
+ *
+ * Copyright (C) 2004, 2006, 2007 Brailcom, o.p.s.
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include <stddef.h>
+
+#include "connection.h"
+
+enum event_type {
+	EVENT_TEXT,		/* Raw text, with its index marks */
+	EVENT_RESET		/* Reopen the connection to Speech Dispatcher */
+};
+
+struct event {
+	enum event_type type;
+	unsigned int stops;	/* Stops requested before it was queued */
+	struct voice_state voice;	/* Voice to say the text with */
+	char *text;		/* Allocated, the receiver frees it */
+	int skipped;		/* Lines a flood summary stands for, or 0 */
+};
+
+/* Bounded queue for exactly one producer and one consumer thread */
+struct queue {
+	struct event *events;
+	size_t size;		/* A power of two */
+	size_t head;		/* Next to pop, written by the consumer */
+	size_t tail;		/* Next to push, written by the producer */
+};
+
+int queue_init(struct queue *queue, size_t size);
+void queue_free(struct queue *queue);
+int queue_push(struct queue *queue, const struct event *event);
+int queue_pop(struct queue *queue, struct event *event);
+
+#endif
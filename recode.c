@@ -0,0 +1,549 @@
+/*
+ * recode.c - Charset conversion and SSML escaping of Speakup text
+ *
+ * Copyright (C) 2004, 2006, 2007 Brailcom, o.p.s.
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <iconv.h>
+#include <math.h>
+
+#include "log.h"
+#include "recode.h"
+#include "scan.h"
+
+#define SSML_BEGIN "<speak>"
+#define SSML_END "</speak>"
+
+/* Longest output of a single input byte: "&apos;" or a 4 byte UTF-8
+   sequence. Index marks expand to less than this per input byte too. */
+#define RECODE_MAX_EXPANSION 6
+
+/* Longest output of an embedded prosody command */
+#define PROSODY_MAX_LEN \
+	sizeof("</prosody><prosody rate=\"-2000%\" pitch=\"-2000%\">")
+
+const char *ssml_less_than = "&lt;";
+const char *ssml_greater_than = "&gt;";
+const char *ssml_ampersand = "&amp;";
+const char *ssml_single_quote = "&apos;";
+const char *ssml_double_quote = "&quot;";
+
+const char *ssml_entities[128];
+int ssml_entity_lengths[128];
+
+/* For unibyte encodings every byte is translated by a table lookup,
+   giving both the plain UTF-8 form (for CHAR) and the SSML escaped
+   form (for SPEAK). A zero ssml_len means the byte is not valid in
+   the encoding and is dropped. */
+struct recode_entry {
+	unsigned char utf8_len;
+	unsigned char ssml_len;
+	char utf8[5];
+	char ssml[7];
+};
+
+/* How text is converted to UTF-8 */
+enum recode_mode {
+	RECODE_TABLE,		/* Unibyte encoding, by recode_table */
+	RECODE_ICONV,		/* Multibyte encoding, by iconv */
+	RECODE_UTF8		/* Already UTF-8, only validated */
+};
+
+static struct recode_entry recode_table[256];
+static enum recode_mode recode_mode;
+
+/* Set if the unibyte encoding is a superset of ASCII, so that runs of
+   ASCII characters without SSML meaning can be copied as they are. */
+static int recode_ascii;
+
+/* What needs attention in raw text (including non-ASCII bytes) and in
+   valid UTF-8 respectively */
+static struct scan_set unibyte_specials;
+static struct scan_set utf8_specials;
+
+/* Multibyte encodings go through iconv, but the descriptor is opened
+   only once. */
+static iconv_t recode_cd = (iconv_t) - 1;
+
+/* Prosody changes (in percent) in effect at the current place of the
+   utterance being recoded */
+static int prosody_rate;
+static int prosody_pitch;
+static int prosody_open;
+
+static struct scan_set command_set;
+
+/* Output buffers, reused from one utterance to the next */
+static char *ssml_buf;
+static size_t ssml_buf_size;
+static char *utf8_buf;
+static size_t utf8_buf_size;
+
+/*
+  init_ssml_char_escapes: initialize the tables that describe SSML character
+  escapes. */
+
+static void init_ssml_char_escapes(void)
+{
+	int i = 0;
+	for (i = 0; i < (sizeof(ssml_entities) / sizeof(char *)); i++) {
+		ssml_entity_lengths[i] = 0;
+		ssml_entities[i] = NULL;
+	}
+	ssml_entities['<'] = ssml_less_than;
+	ssml_entity_lengths['<'] = strlen(ssml_less_than);
+	ssml_entities['>'] = ssml_greater_than;
+	ssml_entity_lengths['>'] = strlen(ssml_greater_than);
+	ssml_entities['&'] = ssml_ampersand;
+	ssml_entity_lengths['&'] = strlen(ssml_ampersand);
+	ssml_entities['\''] = ssml_single_quote;
+	ssml_entity_lengths['\''] = strlen(ssml_single_quote);
+	ssml_entities['\"'] = ssml_double_quote;
+	ssml_entity_lengths['\"'] = strlen(ssml_double_quote);
+}
+
+/* Try to describe the encoding byte by byte. Returns -1 as soon as some
+   byte turns out to be only the beginning of a multibyte character. */
+static int init_recode_table(void)
+{
+	int i;
+	char in, *in_p, *out_p;
+	size_t in_bytes, out_bytes;
+	struct recode_entry *e;
+
+	for (i = 0; i < 256; i++) {
+		e = &recode_table[i];
+		memset(e, 0, sizeof(*e));
+
+		iconv(recode_cd, NULL, NULL, NULL, NULL);
+		in = (char)i;
+		in_p = &in;
+		in_bytes = 1;
+		out_p = e->utf8;
+		out_bytes = sizeof(e->utf8) - 1;
+		if (iconv(recode_cd, &in_p, &in_bytes, &out_p, &out_bytes)
+		    == (size_t) - 1) {
+			if (errno == EINVAL)
+				return -1;
+			/* Not a character of this encoding */
+			continue;
+		}
+		e->utf8_len = out_p - e->utf8;
+		if (e->utf8_len == 1 && e->utf8[0] == 0)
+			e->utf8_len = 0;
+
+		if (e->utf8_len == 1 && !(e->utf8[0] & 0x80)
+		    && ssml_entities[(int)e->utf8[0]] != NULL) {
+			strcpy(e->ssml, ssml_entities[(int)e->utf8[0]]);
+			e->ssml_len = ssml_entity_lengths[(int)e->utf8[0]];
+		} else {
+			memcpy(e->ssml, e->utf8, e->utf8_len);
+			e->ssml_len = e->utf8_len;
+		}
+	}
+
+	recode_ascii = 1;
+	for (i = 1; i < 128; i++)
+		if (recode_table[i].utf8_len != 1
+		    || recode_table[i].utf8[0] != i)
+			recode_ascii = 0;
+	return 0;
+}
+
+void recode_init(const char *coding)
+{
+	static const char specials[] = { RECODE_MARK, '<', '>', '&', '\'',
+		'\"', 0
+	};
+	static const char commands[] = { RECODE_MARK, 0 };
+
+	init_ssml_char_escapes();
+	scan_set_init(&unibyte_specials, specials, 1);
+	scan_set_init(&utf8_specials, specials, 0);
+	scan_set_init(&command_set, commands, 0);
+
+	if (recode_is_utf8(coding)) {
+		recode_mode = RECODE_UTF8;
+		LOG(3, "Speakup output is UTF-8, no conversion needed");
+		return;
+	}
+
+	recode_cd = iconv_open("utf-8", coding);
+	if (recode_cd == (iconv_t) - 1)
+		FATAL(1, "Requested character set conversion not possible"
+		      "by iconv: %s!", strerror(errno));
+
+	if (init_recode_table() == 0) {
+		recode_mode = RECODE_TABLE;
+		iconv_close(recode_cd);
+		recode_cd = (iconv_t) - 1;
+		LOG(3, "Using table conversion for unibyte encoding %s",
+		    coding);
+	} else {
+		recode_mode = RECODE_ICONV;
+		LOG(3, "Using iconv conversion for multibyte encoding %s",
+		    coding);
+	}
+}
+
+void recode_close(void)
+{
+	if (recode_cd != (iconv_t) - 1)
+		iconv_close(recode_cd);
+	recode_cd = (iconv_t) - 1;
+}
+
+int recode_is_utf8(const char *coding)
+{
+	return !strcasecmp(coding, "utf-8") || !strcasecmp(coding, "utf8");
+}
+
+/* Return the length of the valid UTF-8 sequence at p, 0 if it is
+   invalid or -1 if it is valid so far but cut off at end. */
+static int utf8_char_len(const unsigned char *p, const unsigned char *end)
+{
+	int len, i;
+	unsigned char min = 0x80, max = 0xbf;
+
+	if (p[0] < 0x80)
+		return 1;
+	else if (p[0] < 0xc2)
+		return 0;
+	else if (p[0] < 0xe0)
+		len = 2;
+	else if (p[0] < 0xf0) {
+		len = 3;
+		if (p[0] == 0xe0)
+			min = 0xa0;	/* Overlong */
+		else if (p[0] == 0xed)
+			max = 0x9f;	/* Surrogates */
+	} else if (p[0] < 0xf5) {
+		len = 4;
+		if (p[0] == 0xf0)
+			min = 0x90;	/* Overlong */
+		else if (p[0] == 0xf4)
+			max = 0x8f;	/* Above U+10FFFF */
+	} else
+		return 0;
+
+	for (i = 1; i < len; i++) {
+		if (p + i >= end)
+			return -1;
+		if (p[i] < min || p[i] > max)
+			return 0;
+		min = 0x80;
+		max = 0xbf;
+	}
+	return len;
+}
+
+/*
+  recode_complete: return how much of text consists of complete
+  characters. For UTF-8 the last character may still be missing some
+  bytes, which will come with the next input. */
+
+size_t recode_complete(const char *text, size_t len)
+{
+	const unsigned char *p, *end = (const unsigned char *)text + len;
+	int n;
+
+	if (recode_mode != RECODE_UTF8)
+		return len;
+
+	/* Only the last (up to) 3 bytes can be an incomplete sequence */
+	p = (len > 3) ? end - 3 : (const unsigned char *)text;
+	while (p < end) {
+		n = utf8_char_len(p, end);
+		if (n < 0)
+			return (const char *)p - text;
+		p += (n > 0) ? n : 1;
+	}
+	return len;
+}
+
+static int reserve(char **buf, size_t *size, size_t needed)
+{
+	char *new_buf;
+
+	if (needed <= *size)
+		return 0;
+	new_buf = realloc(*buf, needed);
+	if (new_buf == NULL) {
+		LOG(1, "ERROR: Charset conversion failed, reason: %s",
+		    strerror(errno));
+		return -1;
+	}
+	*buf = new_buf;
+	*size = needed;
+	return 0;
+}
+
+/* SSML percentage for a change of a rate or pitch in Speech Dispatcher
+   units. Modules roughly double or halve a setting over the 100 steps
+   between the middle and the end of its range, so this is
+   approximate, but changes of several settings in a row add up the
+   way they do in Speech Dispatcher. */
+static int ssml_percent(int change)
+{
+	return (int)lround(100.0 * (exp2(change / 100.0) - 1.0));
+}
+
+/* Expand the command embedded at *p: an index mark becomes an SSML mark
+   element, a rate or pitch change a new prosody element. Returns the
+   number of input bytes consumed. */
+static size_t put_command(const char *p, const char *end, char **out)
+{
+	const char *q = p + 1;
+	int val;
+
+	while (q < end && *q != 'i' && *q != 'p' && *q != 's')
+		q++;
+	if (q == end)
+		return q - p;
+
+	if (*q == 'i') {
+		*out += sprintf(*out, "<mark name=\"%.*s\"/>",
+				(int)(q - p - 1), p + 1);
+		return q - p + 1;
+	}
+
+	val = strtol(p + 1, NULL, 10);
+	if (*q == 's')
+		prosody_rate = val;
+	else
+		prosody_pitch = val;
+
+	if (prosody_open)
+		*out += sprintf(*out, "</prosody>");
+	prosody_open = (prosody_rate != 0 || prosody_pitch != 0);
+	if (prosody_open) {
+		*out += sprintf(*out, "<prosody");
+		if (prosody_rate != 0)
+			*out += sprintf(*out, " rate=\"%+d%%\"",
+					ssml_percent(prosody_rate));
+		if (prosody_pitch != 0)
+			*out += sprintf(*out, " pitch=\"%+d%%\"",
+					ssml_percent(prosody_pitch));
+		*out += sprintf(*out, ">");
+	}
+	return q - p + 1;
+}
+
+/* Count the embedded commands, each of which may need PROSODY_MAX_LEN */
+static size_t count_commands(const char *text, size_t len)
+{
+	size_t count = 0, n;
+
+	while ((n = scan(&command_set, text, len)) < len) {
+		count++;
+		text += n + 1;
+		len -= n + 1;
+	}
+	return count;
+}
+
+/* Turn UTF-8 into escaped SSML. This is the second half of the iconv
+   path, or all there is to do if Speakup talks UTF-8 itself, in which
+   case the input must be validated too. */
+static char *escape_utf8(char *out, const char *text, size_t len,
+			 int validate)
+{
+	const char *p = text, *end = text + len;
+	unsigned char c;
+	size_t n;
+	int char_len;
+
+	while (p < end) {
+		n = scan(validate ? &unibyte_specials : &utf8_specials, p,
+			 end - p);
+		memcpy(out, p, n);
+		out += n;
+		p += n;
+		if (p == end)
+			break;
+
+		c = *p;
+		if (c == RECODE_MARK) {
+			p += put_command(p, end, &out);
+		} else if (c < 128 && ssml_entities[c] != NULL) {
+			memcpy(out, ssml_entities[c], ssml_entity_lengths[c]);
+			out += ssml_entity_lengths[c];
+			p++;
+		} else if (!validate) {
+			*out++ = c;
+			p++;
+		} else {
+			char_len = utf8_char_len((const unsigned char *)p,
+						 (const unsigned char *)end);
+			if (char_len <= 0) {
+				LOG(1, "ERROR: Invalid UTF-8 byte 0x%x", c);
+				p++;
+				continue;
+			}
+			memcpy(out, p, char_len);
+			out += char_len;
+			p += char_len;
+		}
+	}
+	return out;
+}
+
+static const char *iconv_text(const char *text, size_t *len)
+{
+	char *in_p = (char *)text, *out_p;
+	size_t in_bytes = *len, out_bytes;
+
+	if (reserve(&utf8_buf, &utf8_buf_size, 4 * *len + 1))
+		return NULL;
+	out_p = utf8_buf;
+	out_bytes = utf8_buf_size - 1;
+
+	iconv(recode_cd, NULL, NULL, NULL, NULL);
+	while (in_bytes > 0) {
+		if (iconv(recode_cd, &in_p, &in_bytes, &out_p, &out_bytes)
+		    != (size_t) - 1)
+			break;
+		if (errno == EILSEQ) {
+			/* Skip the invalid byte, say the rest */
+			LOG(1, "ERROR: Invalid byte 0x%x in charset conversion",
+			    (unsigned char)*in_p);
+			in_p++;
+			in_bytes--;
+		} else {
+			LOG(1, "ERROR: Charset conversion failed, reason: %s",
+			    strerror(errno));
+			break;
+		}
+	}
+	*out_p = 0;
+	*len = out_p - utf8_buf;
+	return utf8_buf;
+}
+
+/*
+  recode_ssml: convert raw Speakup text into a complete UTF-8 SSML
+  document. The result lives in a buffer owned by this module and is
+  valid until the next call. */
+
+char *recode_ssml(const char *text, size_t len)
+{
+	const unsigned char *p, *end;
+	const struct recode_entry *e;
+	char *out;
+	size_t n;
+
+	if (recode_mode == RECODE_ICONV) {
+		text = iconv_text(text, &len);
+		if (text == NULL)
+			return NULL;
+	}
+
+	if (reserve(&ssml_buf, &ssml_buf_size,
+		    RECODE_MAX_EXPANSION * len
+		    + PROSODY_MAX_LEN * count_commands(text, len)
+		    + sizeof(SSML_BEGIN SSML_END)))
+		return NULL;
+
+	prosody_rate = prosody_pitch = prosody_open = 0;
+	out = ssml_buf;
+	memcpy(out, SSML_BEGIN, strlen(SSML_BEGIN));
+	out += strlen(SSML_BEGIN);
+
+	if (recode_mode != RECODE_TABLE) {
+		out = escape_utf8(out, text, len, recode_mode == RECODE_UTF8);
+	} else {
+		p = (const unsigned char *)text;
+		end = p + len;
+		while (p < end) {
+			if (recode_ascii) {
+				n = scan(&unibyte_specials, (const char *)p,
+					 end - p);
+				memcpy(out, p, n);
+				out += n;
+				p += n;
+				if (p == end)
+					break;
+			}
+			if (*p == RECODE_MARK) {
+				p += put_command((const char *)p,
+						 (const char *)end, &out);
+				continue;
+			}
+			e = &recode_table[*p++];
+			if (e->ssml_len == 1) {
+				*out++ = e->ssml[0];
+			} else {
+				memcpy(out, e->ssml, e->ssml_len);
+				out += e->ssml_len;
+			}
+		}
+	}
+
+	if (prosody_open)
+		out += sprintf(out, "</prosody>");
+	memcpy(out, SSML_END, sizeof(SSML_END));
+	LOG(5, "Recoded text: |%s|", ssml_buf);
+	return ssml_buf;
+}
+
+/*
+  recode_char: return the UTF-8 form of a single character of the
+  Speakup encoding, or NULL if it has none. */
+
+const char *recode_char(const char *character)
+{
+	size_t len = strlen(character);
+
+	switch (recode_mode) {
+	case RECODE_TABLE:
+		if (recode_table[(unsigned char)*character].utf8_len == 0)
+			return NULL;
+		return recode_table[(unsigned char)*character].utf8;
+	case RECODE_UTF8:
+		if (utf8_char_len((const unsigned char *)character,
+				  (const unsigned char *)character + len)
+		    != len)
+			return NULL;
+		return character;
+	default:
+		if (iconv_text(character, &len) == NULL || len == 0)
+			return NULL;
+		return utf8_buf;
+	}
+}
+
+/*
+  recode_byte: return the UTF-8 form of a byte of a unibyte Speakup
+  encoding, or NULL if it has none or the encoding isn't unibyte. Only
+  the table is read, so any thread may call it. */
+
+const char *recode_byte(unsigned char byte)
+{
+	if (recode_mode != RECODE_TABLE || recode_table[byte].utf8_len == 0)
+		return NULL;
+	return recode_table[byte].utf8;
+}
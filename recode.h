@@ -0,0 +1,42 @@
+/*
+ * recode.h - Charset conversion and SSML escaping of Speakup text
+ *
+ * Copyright (C) 2004, 2006, 2007 Brailcom, o.p.s.
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef RECODE_H
+#define RECODE_H
+
+#include <stddef.h>
+
+/* Index marks and inline prosody changes are kept inside the raw text
+   in Speakup's own notation (RECODE_MARK, a decimal number, and 'i',
+   's' or 'p') until the text is recoded. For 's' and 'p' the number is
+   the change against the start of the utterance in Speech Dispatcher
+   units, where the whole -100 to 100 range of a setting is 200. */
+#define RECODE_MARK 1
+
+void recode_init(const char *coding);
+void recode_close(void);
+int recode_is_utf8(const char *coding);
+size_t recode_complete(const char *text, size_t len);
+char *recode_ssml(const char *text, size_t len);
+const char *recode_char(const char *character);
+const char *recode_byte(unsigned char byte);
+
+#endif
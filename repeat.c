@@ -0,0 +1,111 @@
+/*
+ * repeat.c - Suppression of utterances repeated in a short time
+ *
+ * Copyright (C) 2004, 2006, 2007 Brailcom, o.p.s.
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * Programs like top or watch redraw the same lines over and over, and
+ * Speakup sends them again each time. Utterances are remembered by a
+ * hash of their text and voice, and one seen again within
+ * SuppressRepeats milliseconds of the last time is not said. Every
+ * repeat restarts the time, so a line which stays the same stays
+ * quiet.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "log.h"
+#include "options.h"
+#include "repeat.h"
+
+extern struct spd_options options;
+
+struct repeat_entry {
+	uint64_t hash;
+	long long time;		/* In milliseconds */
+};
+
+static struct repeat_entry cache[REPEAT_CACHE_SIZE];
+static unsigned long suppressed, said;
+
+/* FNV-1a */
+static uint64_t hash_bytes(uint64_t hash, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= p[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+static long long now_ms(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/*
+  repeat_seen: tell whether text was said with the same voice less
+  than SuppressRepeats ago, and remember it. Text the user asked for
+  is only remembered. */
+
+int repeat_seen(const char *text, size_t len,
+		const struct voice_state *voice, int asked)
+{
+	struct repeat_entry *oldest = &cache[0];
+	long long now = now_ms();
+	uint64_t hash;
+	int i;
+
+	hash = hash_bytes(0xcbf29ce484222325ULL, text, len);
+	hash = hash_bytes(hash, voice, sizeof(*voice));
+
+	for (i = 0; i < REPEAT_CACHE_SIZE; i++) {
+		if (cache[i].hash == hash && cache[i].time != 0) {
+			if (!asked
+			    && now - cache[i].time < options.suppress_repeats) {
+				cache[i].time = now;
+				suppressed++;
+				LOG(5, "Repeated text not said (%lu repeats, "
+				    "%lu said)", suppressed, said);
+				return 1;
+			}
+			oldest = &cache[i];
+			break;
+		}
+		if (cache[i].time < oldest->time)
+			oldest = &cache[i];
+	}
+
+	oldest->hash = hash;
+	oldest->time = now;
+	said++;
+	return 0;
+}
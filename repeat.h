@@ -0,0 +1,35 @@
+/*
+ * repeat.h - Suppression of utterances repeated in a short time
+ *
+ * Copyright (C) 2004, 2006, 2007 Brailcom, o.p.s.
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef REPEAT_H
+#define REPEAT_H
+
+#include <stddef.h>
+
+#include "connection.h"
+
+/* Number of recent utterances remembered */
+#define REPEAT_CACHE_SIZE 32
+
+int repeat_seen(const char *text, size_t len,
+		const struct voice_state *voice, int asked);
+
+#endif
@@ -0,0 +1,131 @@
+/*
+ * ring.c - Ring buffer for the input from Speakup
+ *
+ * Copyright (C) 2004, 2006, 2007 Brailcom, o.p.s.
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+/* For memrchr() */
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/uio.h>
+
+#include "ring.h"
+
+int ring_init(struct ring *ring, size_t size)
+{
+	ring->data = malloc(size);
+	if (ring->data == NULL)
+		return -1;
+	ring->size = size;
+	ring->head = 0;
+	ring->len = 0;
+	return 0;
+}
+
+void ring_free(struct ring *ring)
+{
+	free(ring->data);
+	ring->data = NULL;
+	ring->size = 0;
+}
+
+size_t ring_space(const struct ring *ring)
+{
+	return ring->size - ring->len;
+}
+
+/*
+  ring_read: read as much as fits from fd into the free space of the
+  ring, which may wrap around its end. Returns what read() returns. */
+
+ssize_t ring_read(struct ring *ring, int fd)
+{
+	struct iovec iov[2];
+	size_t tail = (ring->head + ring->len) % ring->size;
+	size_t space = ring_space(ring);
+	int iovcnt = 1;
+	ssize_t bytes;
+
+	if (space == 0)
+		return 0;
+
+	iov[0].iov_base = ring->data + tail;
+	if (tail + space <= ring->size) {
+		iov[0].iov_len = space;
+	} else {
+		iov[0].iov_len = ring->size - tail;
+		iov[1].iov_base = ring->data;
+		iov[1].iov_len = space - iov[0].iov_len;
+		iovcnt = 2;
+	}
+
+	bytes = readv(fd, iov, iovcnt);
+	if (bytes > 0)
+		ring->len += bytes;
+	return bytes;
+}
+
+/*
+  ring_peek: return the oldest contiguous block of data in the ring and
+  its length in len. */
+
+const char *ring_peek(const struct ring *ring, size_t *len)
+{
+	if (ring->head + ring->len <= ring->size)
+		*len = ring->len;
+	else
+		*len = ring->size - ring->head;
+	return ring->data + ring->head;
+}
+
+void ring_consume(struct ring *ring, size_t len)
+{
+	assert(len <= ring->len);
+	ring->head = (ring->head + len) % ring->size;
+	ring->len -= len;
+	if (ring->len == 0)
+		ring->head = 0;
+}
+
+/*
+  ring_rfind: return the offset from the oldest byte of the last
+  occurrence of c in the ring, or -1 if there is none. */
+
+ssize_t ring_rfind(const struct ring *ring, char c)
+{
+	const char *p;
+	size_t first;
+
+	ring_peek(ring, &first);
+	if (ring->len > first) {
+		p = memrchr(ring->data, c, ring->len - first);
+		if (p != NULL)
+			return first + (p - ring->data);
+	}
+	p = memrchr(ring->data + ring->head, c, first);
+	if (p != NULL)
+		return p - (ring->data + ring->head);
+	return -1;
+}
@@ -0,0 +1,42 @@
+/*
+ * ring.h - Ring buffer for the input from Speakup
+ *
+ * Copyright (C) 2004, 2006, 2007 Brailcom, o.p.s.
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef RING_H
+#define RING_H
+
+#include <sys/types.h>
+
+struct ring {
+	char *data;
+	size_t size;
+	size_t head;		/* Offset of the oldest byte */
+	size_t len;		/* Number of bytes stored */
+};
+
+int ring_init(struct ring *ring, size_t size);
+void ring_free(struct ring *ring);
+size_t ring_space(const struct ring *ring);
+ssize_t ring_read(struct ring *ring, int fd);
+const char *ring_peek(const struct ring *ring, size_t *len);
+void ring_consume(struct ring *ring, size_t len);
+ssize_t ring_rfind(const struct ring *ring, char c);
+
+#endif
@@ -0,0 +1,153 @@
+/*
+ * scan.c - Fast search for special bytes in Speakup text
+ *
+ * Copyright (C) 2004, 2006, 2007 Brailcom, o.p.s.
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * Most of what Speakup sends is plain text without any control bytes
+ * or characters needing an SSML escape, so runs of such text are
+ * searched 16 or 32 bytes at a time and copied in one piece. The
+ * implementation is chosen at run time according to the CPU.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+#include "log.h"
+#include "scan.h"
+
+static size_t scan_scalar(const struct scan_set *set, const char *p,
+			  size_t len)
+{
+	const unsigned char *s = (const unsigned char *)p;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		if (set->table[s[i]])
+			break;
+	return i;
+}
+
+#ifdef SCAN_X86
+
+__attribute__ ((target("sse2")))
+static size_t scan_sse2(const struct scan_set *set, const char *p,
+			size_t len)
+{
+	__m128i wanted[SCAN_MAX_BYTES];
+	__m128i chunk, hit;
+	size_t i;
+	int k, mask;
+
+	for (k = 0; k < set->n; k++)
+		wanted[k] = _mm_set1_epi8(set->bytes[k]);
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		chunk = _mm_loadu_si128((const __m128i *)(p + i));
+		hit = _mm_setzero_si128();
+		for (k = 0; k < set->n; k++)
+			hit = _mm_or_si128(hit, _mm_cmpeq_epi8(chunk, wanted[k]));
+		mask = _mm_movemask_epi8(hit);
+		if (set->high)
+			mask |= _mm_movemask_epi8(chunk);
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+	return i + scan_scalar(set, p + i, len - i);
+}
+
+__attribute__ ((target("avx2")))
+static size_t scan_avx2(const struct scan_set *set, const char *p,
+			size_t len)
+{
+	__m256i wanted[SCAN_MAX_BYTES];
+	__m256i chunk, hit;
+	size_t i;
+	unsigned int mask;
+	int k;
+
+	for (k = 0; k < set->n; k++)
+		wanted[k] = _mm256_set1_epi8(set->bytes[k]);
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		chunk = _mm256_loadu_si256((const __m256i *)(p + i));
+		hit = _mm256_setzero_si256();
+		for (k = 0; k < set->n; k++)
+			hit = _mm256_or_si256(hit,
+					      _mm256_cmpeq_epi8(chunk,
+								wanted[k]));
+		mask = _mm256_movemask_epi8(hit);
+		if (set->high)
+			mask |= _mm256_movemask_epi8(chunk);
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+	return i + scan_scalar(set, p + i, len - i);
+}
+
+#endif /* SCAN_X86 */
+
+size_t(*scan) (const struct scan_set * set, const char *p, size_t len) =
+    scan_scalar;
+
+void scan_init(void)
+{
+#ifdef SCAN_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		scan = scan_avx2;
+		LOG(4, "Using AVX2 text scanner");
+		return;
+	}
+	if (__builtin_cpu_supports("sse2")) {
+		scan = scan_sse2;
+		LOG(4, "Using SSE2 text scanner");
+		return;
+	}
+#endif
+	scan = scan_scalar;
+	LOG(4, "Using scalar text scanner");
+}
+
+void scan_set_init(struct scan_set *set, const char *bytes, int high)
+{
+	int i;
+
+	set->n = strlen(bytes);
+	assert(set->n <= SCAN_MAX_BYTES);
+	memcpy(set->bytes, bytes, set->n);
+	set->high = high;
+
+	memset(set->table, 0, sizeof(set->table));
+	for (i = 0; i < set->n; i++)
+		set->table[(unsigned char)bytes[i]] = 1;
+	if (high)
+		for (i = 128; i < 256; i++)
+			set->table[i] = 1;
+}
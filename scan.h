@@ -0,0 +1,46 @@
+/*
+ * scan.h - Fast search for special bytes in Speakup text
+ *
+ * Copyright (C) 2004, 2006, 2007 Brailcom, o.p.s.
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stddef.h>
+
+#define SCAN_MAX_BYTES 8
+
+/* The bytes to stop at. If high is set, every byte above 127 is
+   matched as well. */
+struct scan_set {
+	int n;
+	int high;
+	unsigned char bytes[SCAN_MAX_BYTES];
+	unsigned char table[256];
+};
+
+void scan_init(void);
+void scan_set_init(struct scan_set *set, const char *bytes, int high);
+
+/* Return the offset of the first byte of p belonging to set, or len
+   if there is none. */
+extern size_t(*scan) (const struct scan_set * set, const char *p,
+		      size_t len);
+
+#endif
@@ -26,44 +26,238 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <assert.h>
 #include <stdarg.h>
 #include <signal.h>
 #include <ctype.h>
+#include <limits.h>
 #include <locale.h>
+#include <time.h>
+#include <pthread.h>
 
 #include <wchar.h>
 #include <wctype.h>
 
-#include <iconv.h>
 #include <libspeechd.h>
 
 #include "log.h"
 #include "options.h"
 #include "configuration.h"
+#include "recode.h"
+#include "scan.h"
+#include "ring.h"
+#include "queue.h"
+#include "normalize.h"
+#include "repeat.h"
+#include "substitute.h"
+#include "connection.h"
 
 #define BUF_SIZE 1024
 
+/* Size of the input ring, i.e. the most we read from Speakup at once */
+#define INPUT_SIZE (BUF_SIZE * 64)
+
+/* Pending text is said without waiting for its end before it grows
+   longer than this */
+#define TEXT_MAX (BUF_SIZE * 16)
+
+/* Longest InlineProsody mark: RECODE_MARK, an int and its type */
+#define PROSODY_MARK_LEN 16
+
+/* Trailing text is held for at most this many FlushDelays in all,
+   however closely its pieces follow each other */
+#define FLUSH_HOLD_MAX 8
+
+/* Most events waiting for the dispatcher thread */
+#define QUEUE_SIZE 256
+
+/* Bounds of the wait in ms before connecting to Speech Dispatcher again */
+#define RECONNECT_MIN_DELAY 100
+#define RECONNECT_MAX_DELAY 10000
+
 #define DTLK_STOP 24
 #define DTLK_CMD 1
 
+/* The device of kernels whose Speakup can send UTF-8 */
+#define SOFTSYNTHU_DEVICE "/dev/softsynthu"
+
 extern struct spd_options options;
 
 int fd;
-fd_set fd_list;
-fd_set fd_write;
-SPDConnection *conn;
+struct connection conn;
+
+/* Timer for saying the text at the end of a read, unless more of it
+   arrives within FlushDelay. flush_forced is set when it is armed for
+   the end of FLUSH_HOLD_MAX rather than for a pause in the input. */
+int flush_timer = -1;
+int flush_armed;
+int flush_forced;
+struct timespec flush_since;
+
+/* With NavigationDebounce, stops coming one after another arm this
+   timer, and what is dispatched meanwhile is held until it fires. Each
+   stop drops what was held, so only the last text is said. */
+int debounce_timer = -1;
+int navigating;
+struct event *held;
+size_t n_held;
+size_t held_size;
+
+/* With SeparateEcho, single characters go through their own connection
+   so that they don't wait behind text */
+struct connection echo_conn;
+
+/* Voice settings as last requested by Speakup */
+struct voice_state voice_wanted = {
+	VOICE_UNSET, VOICE_UNSET, VOICE_UNSET, VOICE_UNSET
+};
+
+/* Priority used for the echo of single characters */
+int echo_priority = SPD_TEXT;
+
+/* The word being typed, for TypingEcho words or both */
+char echo_word[64];
+size_t echo_word_len;
+
+/* Set when Speakup sends UTF-8 rather than a unibyte encoding */
+int utf8_input;
+
+/* Bytes interrupting the text in Speakup's output */
+static const char control_chars[] = { DTLK_STOP, DTLK_CMD, 0 };
+
+struct scan_set control_bytes;
+
+/* State of the Speakup protocol parser, kept between reads */
+enum parse_state {
+	PARSE_TEXT,		/* Ordinary text */
+	PARSE_SIGN,		/* After DTLK_CMD, maybe a sign follows */
+	PARSE_DIGITS		/* Digits of the parameter or the command */
+};
+
+struct parser {
+	enum parse_state state;
+	int pm;
+	char digits[16];
+	int n_digits;
+	char cmd_type;
+	unsigned int param;
+	struct voice_state voice;	/* Voice at the start of the text */
+	char *text;		/* Raw text waiting to be said */
+	size_t text_len;
+	size_t text_size;
+	int text_chars;		/* Bytes of text in it, not counting marks */
+	int skipping;		/* In input which a later stop cancels */
+	int after_stop;		/* No text said since the last stop */
+};
+
+struct parser parser = {
+	.state = PARSE_TEXT,
+	.cmd_type = ' ',
+};
+
+struct ring input;
+
+/* The last text dispatched, for SpeakNewSuffix */
+struct {
+	char *text;
+	size_t len;
+	size_t size;
+	struct voice_state voice;
+} last_said;
+
+/* InlineProsody changes against the voice of a text, carried over into
+   a later part of it which is sent on its own */
+struct prosody_carry {
+	int rate;
+	int pitch;
+};
+
+/* Speakup's device is read and parsed in the main thread, which passes
+   the results through this queue to the dispatcher thread talking to
+   Speech Dispatcher, so that a slow server never holds up the reading. */
+struct queue events;
+pthread_t dispatcher_thread;
+
+/* The main thread writes to it to wake the dispatcher up */
+int wake_pipe[2] = { -1, -1 };
+
+/* DTLK_STOP bypasses the queue: the dispatcher compares the number of
+   stops seen by the reader with the number it has handled, and drops
+   the text queued before the last stop. */
+unsigned int stops_requested;
+unsigned int stops_handled;
+
+/* Set by SIGHUP or a reset the queue has no room for, and by SIGINT
+   once the dispatcher runs */
+int reset_requested;
+int terminate_requested;
+int dispatcher_running;
+
+/* SIGINT wakes the main loop through it once the dispatcher runs. The
+   main thread then stops the dispatcher and waits for it before it
+   terminates, so that nothing else uses the connections or the log. */
+int terminate_event = -1;
+
+/* Connections opened ahead for speechd_reset(). Opening waits for the
+   server, so it is done by a thread of its own, which also closes the
+   connections the last reset put aside. The dispatcher only touches
+   them while standby_ready is set. */
+struct connection standby;
+struct connection echo_standby;
+int standby_ready;
+int standby_opening;
+pthread_t standby_thread;
+int standby_started;	/* standby_thread is still to be joined */
+
+/* While Speech Dispatcher can't be reached, the dispatcher tries to
+   connect again at reconnect_at, waiting twice as long after each
+   failure. The newest OutageBuffer messages are kept meanwhile and
+   said once the connection is back, after the voice settings the old
+   connections had. */
+int connected;
+int reconnect_delay = RECONNECT_MIN_DELAY;
+struct timespec reconnect_at;
+struct voice_state lost_voice;
+struct voice_state lost_echo_voice;
+struct event *outage;
+size_t n_outage;
+int replaying;		/* Saying the messages kept */
+
+/* Index marks reached are written back to Speakup by the main thread.
+   Only the newest one matters, so the callback replaces the one waiting
+   (-1 if none) and wakes the main loop up through mark_event. A mark
+   the device doesn't take at once waits in mark_unwritten until it is
+   writable. */
+int mark_waiting = -1;
+int mark_event = -1;
+int mark_unwritten = -1;
+int mark_polling;
+
+/* With a FloodPolicy, the dispatcher only lets FloodBacklog messages
+   wait in Speech Dispatcher and holds the following ones here, oldest
+   first. When more than FloodLimit are held, the policy drops some. */
+struct event *backlog;
+size_t n_backlog;
+size_t backlog_bytes;
 
 char *spd_spk_pid_file;
 
-void init_ssml_char_escapes(void);
 void spd_spk_reset(int sig);
+static void wake_dispatcher(void);
+static void terminate(void);
+void dispatch(enum event_type type, const char *text, size_t len,
+	      const struct voice_state *voice);
 
 /* Lifted directly from speechd/src/modules/module_utils.c. */
 void xfree(void *data)
@@ -73,38 +267,184 @@ void xfree(void *data)
 }
 
 void
-index_marker_callback(size_t msg_id, size_t client_id, SPDNotificationType type,
-		      char *index_mark)
+index_marker_callback(enum ssip_event event, size_t msg_id,
+		      const char *index_mark)
 {
-	//LOG(5,"Index Mark Callback");
-	if (index_mark != NULL)
-		if (write(fd, index_mark, sizeof(index_mark)) < 0)
-			LOG(1, "Unable to write index mark: %s\n",
-			    strerror(errno));
+	char *end;
+	long mark;
+
+	if (event == SSIP_INDEX_MARK && index_mark != NULL
+	    && mark_event != -1) {
+		mark = strtol(index_mark, &end, 10);
+		if (end == index_mark || *end != 0 || mark < 0
+		    || mark > INT_MAX) {
+			LOG(1, "ERROR: Unknown index mark %s", index_mark);
+		} else {
+			__atomic_store_n(&mark_waiting, (int)mark,
+					 __ATOMIC_RELEASE);
+			if (eventfd_write(mark_event, 1) < 0 && errno != EAGAIN)
+				LOG(1, "ERROR: Can't pass index mark: %s",
+				    strerror(errno));
+		}
+	}
+
+	/* There may be room for held messages now */
+	if ((event == SSIP_END || event == SSIP_CANCEL)
+	    && options.flood_policy != FLOOD_NONE)
+		wake_dispatcher();
 }
 
-void speechd_init()
+static int open_connections(struct connection *c, struct connection *echo)
 {
-	conn = spd_open("speakup", "softsynth", "test", SPD_MODE_THREADED);
-	if (conn == 0)
-		FATAL(1, "ERROR! Can't connect to Speech Dispatcher!");
-	conn->callback_im = index_marker_callback;
-	if (spd_set_notification_on(conn, SPD_INDEX_MARKS) == -1)
-		LOG(1, "Error turning on Index Mark Callback");
+	if (conn_open(c, "softsynth", index_marker_callback))
+		return -1;
+	if (options.separate_echo
+	    && conn_open(echo, "echo", index_marker_callback)) {
+		conn_close(c);
+		return -1;
+	}
+	return 0;
+}
 
-	if (options.language_set != DEFAULT)
-		if (spd_set_language(conn, options.language) == -1)
-			LOG(1, "Error setting language");
+static void close_connections(struct connection *c,
+			      struct connection *echo)
+{
+	conn_close(c);
+	if (options.separate_echo)
+		conn_close(echo);
+}
+
+/* Try to connect again in delay milliseconds */
+static void reconnect_later(int delay)
+{
+	clock_gettime(CLOCK_MONOTONIC, &reconnect_at);
+	reconnect_at.tv_sec += delay / 1000;
+	reconnect_at.tv_nsec += (delay % 1000) * 1000000L;
+	if (reconnect_at.tv_nsec >= 1000000000L) {
+		reconnect_at.tv_sec++;
+		reconnect_at.tv_nsec -= 1000000000L;
+	}
+}
+
+void speechd_init()
+{
+	if (open_connections(&conn, &echo_conn) == 0) {
+		connected = 1;
+	} else {
+		if (options.probe_mode)
+			FATAL(1, "ERROR! Can't connect to Speech Dispatcher!");
+		LOG(1, "ERROR: Can't connect to Speech Dispatcher, "
+		    "trying again later");
+		lost_voice = voice_unset;
+		lost_echo_voice = voice_unset;
+		reconnect_later(RECONNECT_MIN_DELAY);
+	}
 
-	if (spd_set_capital_letters(conn, SPD_CAP_NONE) == -1)
-		LOG(1, "Unable to set capital letter recognition");
+	recode_init(options.speakup_coding);
 
-	init_ssml_char_escapes();
+	echo_priority = conn_priority(options.echo_priority);
 }
 
 void speechd_close()
 {
-	spd_close(conn);
+	conn_close(&conn);
+	if (options.separate_echo)
+		conn_close(&echo_conn);
+	/* Wait for standby connections being opened, so that they are
+	   closed too */
+	if (standby_started)
+		pthread_join(standby_thread, NULL);
+	standby_started = 0;
+	close_connections(&standby, &echo_standby);
+	__atomic_store_n(&standby_ready, 0, __ATOMIC_RELEASE);
+	recode_close();
+}
+
+static void *open_standby(void *arg)
+{
+	close_connections(&standby, &echo_standby);
+	if (open_connections(&standby, &echo_standby))
+		LOG(1, "ERROR: Can't open a standby connection");
+	else
+		__atomic_store_n(&standby_ready, 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&standby_opening, 0, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+/*
+  start_standby: open the standby connections in the background,
+  unless they are already open or being opened. Signals are left to
+  the main thread. */
+
+static void start_standby(void)
+{
+	sigset_t all, old;
+
+	if (__atomic_load_n(&standby_ready, __ATOMIC_ACQUIRE)
+	    || __atomic_exchange_n(&standby_opening, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	/* The last thread is done, or just about to return */
+	if (standby_started)
+		pthread_join(standby_thread, NULL);
+	standby_started = 0;
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	if (pthread_create(&standby_thread, NULL, open_standby, NULL)) {
+		LOG(1, "ERROR: Can't start the standby thread");
+		__atomic_store_n(&standby_opening, 0, __ATOMIC_RELEASE);
+	} else {
+		standby_started = 1;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/*
+  connection_lost: close the connections to Speech Dispatcher and
+  connect again as soon as the dispatcher gets to it. */
+
+static void connection_lost(void)
+{
+	if (!connected)
+		return;
+	lost_voice = conn.voice;
+	lost_echo_voice = echo_conn.voice;
+	close_connections(&conn, &echo_conn);
+	/* A standby opened before is most likely gone as well */
+	if (__atomic_exchange_n(&standby_ready, 0, __ATOMIC_ACQ_REL))
+		close_connections(&standby, &echo_standby);
+	connected = 0;
+	reconnect_later(0);
+}
+
+/*
+  speechd_reset: put the standby connections in the place of those in
+  use, or reconnect if there are none yet, and send them the voice
+  settings of the old ones at once. */
+
+static void speechd_reset(void)
+{
+	struct voice_state voice = conn.voice;
+	struct voice_state echo_voice = echo_conn.voice;
+
+	if (!connected || !__atomic_load_n(&standby_ready, __ATOMIC_ACQUIRE)) {
+		connection_lost();
+		reconnect_delay = RECONNECT_MIN_DELAY;
+		reconnect_later(0);
+		return;
+	}
+
+	conn_swap(&conn, &standby);
+	if (options.separate_echo)
+		conn_swap(&echo_conn, &echo_standby);
+	__atomic_store_n(&standby_ready, 0, __ATOMIC_RELEASE);
+	LOG(4, "Switched to the standby connection");
+
+	conn_sync_voice(&conn, &voice);
+	if (options.separate_echo)
+		conn_sync_voice(&echo_conn, &echo_voice);
+	start_standby();
 }
 
 int init_speakup_tables()
@@ -144,7 +484,7 @@ int init_speakup_tables()
 
 void process_command(char command, unsigned int param, int pm)
 {
-	int val, ret = 0;
+	int val;
 	static int currate = 5, curpitch = 5;
 
 	LOG(5, "cmd: %c, param: %d, rel: %d", command, param, pm);
@@ -154,72 +494,67 @@ void process_command(char command, unsigned int param, int pm)
 	switch (command) {
 
 	case '@':		/* Reset speechd connection */
-		LOG(5, "resetting speech dispatcher connection");
-		spd_spk_reset(0);
+		dispatch(EVENT_RESET, NULL, 0, NULL);
 		break;
 
 	case 'b':		/* set punctuation level */
 		switch (param) {
 		case 0:
 			LOG(5, "[punctuation all]");
-			ret = spd_set_punctuation(conn, SPD_PUNCT_ALL);
+			voice_wanted.punctuation = SPD_PUNCT_ALL;
 			break;
 		case 1:
 		case 2:
 			LOG(5, "[punctuation some]");
-			ret = spd_set_punctuation(conn, SPD_PUNCT_SOME);
+			voice_wanted.punctuation = SPD_PUNCT_SOME;
 			break;
 		case 3:
 			LOG(5, "[punctuation none]");
-			ret = spd_set_punctuation(conn, SPD_PUNCT_NONE);
+			voice_wanted.punctuation = SPD_PUNCT_NONE;
 			break;
 		default:
 			LOG(1, "ERROR: Invalid punctuation mode!");
 		}
-		if (ret == -1)
-			LOG(1, "ERROR: Can't set punctuation mode");
 		break;
 
 	case 'o':		/* set voice */
 		switch (param) {
 		case 0:
 			LOG(5, "[Voice MALE1]");
-			ret = spd_set_voice_type(conn, SPD_MALE1);
+			voice_wanted.voice_type = SPD_MALE1;
 			break;
 		case 1:
 			LOG(5, "[Voice MALE2]");
-			ret = spd_set_voice_type(conn, SPD_MALE2);
+			voice_wanted.voice_type = SPD_MALE2;
 			break;
 		case 2:
 			LOG(5, "[Voice MALE3]");
-			ret = spd_set_voice_type(conn, SPD_MALE3);
+			voice_wanted.voice_type = SPD_MALE3;
 			break;
 		case 3:
 			LOG(5, "[Voice FEMALE1]");
-			ret = spd_set_voice_type(conn, SPD_FEMALE1);
+			voice_wanted.voice_type = SPD_FEMALE1;
 			break;
 		case 4:
 			LOG(5, "[Voice FEMALE2]");
-			ret = spd_set_voice_type(conn, SPD_FEMALE2);
+			voice_wanted.voice_type = SPD_FEMALE2;
 			break;
 		case 5:
 			LOG(5, "[Voice FEMALE3]");
-			ret = spd_set_voice_type(conn, SPD_FEMALE3);
+			voice_wanted.voice_type = SPD_FEMALE3;
 			break;
 		case 6:
 			LOG(5, "[Voice CHILD_MALE]");
-			ret = spd_set_voice_type(conn, SPD_CHILD_MALE);
+			voice_wanted.voice_type = SPD_CHILD_MALE;
 			break;
 		case 7:
 			LOG(5, "[Voice CHILD_FEMALE]");
-			ret = spd_set_voice_type(conn, SPD_CHILD_FEMALE);
+			voice_wanted.voice_type = SPD_CHILD_FEMALE;
 			break;
 		default:
 			LOG(1, "ERROR: Invalid voice %d!", param);
 			break;
 		}
-		if (ret == -1)
-			LOG(1, "ERROR: Can't set voice!");
 		break;
 
 	case 'p':		/* set pitch command */
@@ -230,9 +565,7 @@ void process_command(char command, unsigned int param, int pm)
 		val = (curpitch - 5) * 20;
 		assert((val >= -100) && (val <= +100));
 		LOG(5, "[pitch %d, param: %d]", val, param);
-		ret = spd_set_voice_pitch(conn, val);
-		if (ret == -1)
-			LOG(1, "ERROR: Can't set pitch!");
+		voice_wanted.pitch = val;
 		break;
 
 	case 's':		/* speech rate */
@@ -243,9 +576,7 @@ void process_command(char command, unsigned int param, int pm)
 		val = (currate * 22) - 100;
 		assert((val >= -100) && (val <= +100));
 		LOG(5, "[rate %d, param: %d]", val, param);
-		ret = spd_set_voice_rate(conn, val);
-		if (ret == -1)
-			LOG(1, "ERROR: Invalid rate!");
+		voice_wanted.rate = val;
 		break;
 
 	case 'f':
@@ -276,291 +607,1391 @@ in the situations while the characters are generated by reding
 characters when moving with the cursor. It is currently impossible
 to distinguish KEYs from CHARacters in Speakup.
 */
-int say_single_character(char *character)
+int say_single_character(char *character, const struct voice_state *voice)
 {
-	int ret;
-	char cmd[13];
+	struct connection *c = options.separate_echo ? &echo_conn : &conn;
 
 	if (!strcmp(character, "\n"))
 		return 0;
 
 	LOG(5, "Saying single character: |%s|", character);
 
-	/* It seems there is a bug in some versions of libspeechd
-	   in function spd_say_char() */
-	snprintf(cmd, 12, "CHAR %s", character);
-	ret = spd_execute_command(conn, "SET SELF PRIORITY TEXT");
-	if (ret != 0)
-		return ret;
-	ret = spd_execute_command(conn, cmd);
-	if (ret != 0)
-		return ret;
+	conn_sync_voice(c, voice);
+	if (conn_char(c, echo_priority, character))
+		return -2;
+	return 0;
+}
+
+/*
+  speak_string: send a string containing more than one printable character 
+  to Speech Dispatcher. Returns -2 if sending fails, -1 on other errors. */
 
+int speak_string(char *text, const struct voice_state *voice)
+{
+	char *ssml_text;
+
+	ssml_text = recode_ssml(text, strlen(text));
+	if (ssml_text == NULL)
+		return -1;
+	LOG(5, "Sending to speechd as text: |%s|", ssml_text);
+	conn_sync_voice(&conn, voice);
+	if (conn_say(&conn, SPD_MESSAGE, ssml_text))
+		return -2;
 	return 0;
 }
 
-const char *ssml_less_than = "&lt;";
-const char *ssml_greater_than = "&gt;";
-const char *ssml_ampersand = "&amp;";
-const char *ssml_single_quote = "&apos;";
-const char *ssml_double_quote = "&quot;";
+/* Say the word typed so far, if TypingEcho asks for words */
+static int echo_word_end(const struct voice_state *voice)
+{
+	struct connection *c = options.separate_echo ? &echo_conn : &conn;
+	char *ssml_text;
 
-const char *ssml_entities[128];
-int ssml_entity_lengths[128];
+	if (echo_word_len == 0)
+		return 0;
+	ssml_text = recode_ssml(echo_word, echo_word_len);
+	echo_word_len = 0;
+	if (ssml_text == NULL)
+		return -1;
+	LOG(5, "Sending to speechd as word: |%s|", ssml_text);
+	conn_sync_voice(c, voice);
+	if (conn_say(c, echo_priority, ssml_text))
+		return -2;
+	return 0;
+}
 
 /*
-  init_ssml_char_escapes: initialize the tables that describe SSML character
-  escapes. */
+  echo_character: say a single character, which is most often a key
+  just typed. Letters and digits are also collected into a word, which
+  is said when something else is typed. TypingEcho decides which of
+  the two are said. */
 
-void init_ssml_char_escapes(void)
+static int echo_character(char *text, const char *character,
+			  const struct voice_state *voice)
 {
-	int i = 0;
-	for (i = 0; i < (sizeof(ssml_entities) / sizeof(char *)); i++) {
-		ssml_entity_lengths[i] = 0;
-		ssml_entities[i] = NULL;
+	const char *utf8_text;
+	size_t len = strlen(character);
+	int ret = 0;
+
+	if (options.typing_echo != ECHO_CHARACTERS) {
+		if (isalnum((unsigned char)*character)
+		    || (unsigned char)*character >= 0x80) {
+			if (echo_word_len + len <= sizeof(echo_word)) {
+				memcpy(echo_word + echo_word_len, character,
+				       len);
+				echo_word_len += len;
+			}
+		} else {
+			ret = echo_word_end(voice);
+		}
+		if (options.typing_echo == ECHO_WORDS)
+			return ret;
 	}
-	ssml_entities['<'] = ssml_less_than;
-	ssml_entity_lengths['<'] = strlen(ssml_less_than);
-	ssml_entities['>'] = ssml_greater_than;
-	ssml_entity_lengths['>'] = strlen(ssml_greater_than);
-	ssml_entities['&'] = ssml_ampersand;
-	ssml_entity_lengths['&'] = strlen(ssml_ampersand);
-	ssml_entities['\''] = ssml_single_quote;
-	ssml_entity_lengths['\''] = strlen(ssml_single_quote);
-	ssml_entities['\"'] = ssml_double_quote;
-	ssml_entity_lengths['\"'] = strlen(ssml_double_quote);
+
+	if (isupper((unsigned char)*character))
+		return speak_string(text, voice);
+
+	utf8_text = recode_char(character);
+	if (utf8_text == NULL)
+		return -1;
+	LOG(5, "Sending to speechd as character: |%s|", utf8_text);
+	return say_single_character((char *)utf8_text, voice);
 }
 
-char *recode_text(char *text)
+int speak(char *text, const struct voice_state *voice)
 {
-	iconv_t cd;
-	size_t in_bytes, out_bytes, enc_bytes;
-	char *utf8_text, *out_p;
+	/* Check whether text contains more than one
+	   printable character. If so, use spd_say,
+	   otherwise use say_single_character.
 
-	utf8_text = malloc(4 * strlen(text) + 1);
-	if (utf8_text == NULL) {
-		LOG(1, "ERROR: Charset conversion failed, reason: %s",
-		    strerror(errno));
-		return NULL;
+	   Returns 0 on success, -2 on speechd communication
+	   errors, -1 on other errors.
+	 */
+
+	int printables = 0;
+	int i, char_len = 0, in_first = 0;
+	int ret = 0;
+	char character[5];
+
+	assert(text);
+	for (i = 0; text[i] != 0; i++) {
+		/* Continuation bytes of UTF-8 characters don't count */
+		if (utf8_input && (text[i] & 0xc0) == 0x80) {
+			if (in_first && char_len < 4)
+				character[char_len++] = text[i];
+			continue;
+		}
+		in_first = 0;
+		if (!isspace((unsigned char)text[i])) {
+			if (printables == 0) {
+				character[0] = text[i];
+				char_len = 1;
+				in_first = 1;
+			}
+			printables++;
+		}
 	}
+	character[char_len] = 0;
 
-	out_p = utf8_text;
-	out_bytes = 4 * strlen(text);
-	in_bytes = strlen(text);
+	LOG(5, "Text before recoding: |%s|", text);
 
-	/* Initialize ICONV for charset conversion */
-	cd = iconv_open("utf-8", options.speakup_coding);
-	if (cd == (iconv_t) - 1)
-		FATAL(1, "Requested character set conversion not possible"
-		      "by iconv: %s!", strerror(errno));
+	if (printables == 1) {
+		ret = echo_character(text, character, voice);
+	} else if (printables > 1) {
+		/* Something else than typing */
+		echo_word_len = 0;
+		ret = speak_string(text, voice);
+	} else if (text[0] != 0) {
+		/* A space or a new line ends the word typed */
+		ret = echo_word_end(voice);
+	}
 
-	enc_bytes = iconv(cd, &text, &in_bytes, &out_p, &out_bytes);
-	if (enc_bytes == -1) {
-		LOG(1, "ERROR: Charset conversion failed, reason: %s",
-		    strerror(errno));
-		utf8_text = NULL;
+	if (ret == -1)
+		LOG(1, "ERROR: Can't convert the text, not saying it");
+	return ret;
+}
+
+/* Create a timer for the main loop to watch, or return -1 */
+static int add_timer(int epoll_fd)
+{
+	struct epoll_event event;
+	int timer;
+
+	timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	if (timer == -1)
+		return -1;
+	event.events = EPOLLIN;
+	event.data.fd = timer;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer, &event) == -1) {
+		close(timer);
+		return -1;
+	}
+	return timer;
+}
+
+/* Make timer fire once in ms milliseconds, or never if ms is 0 */
+static int arm_timer(int timer, int ms)
+{
+	struct itimerspec when;
+
+	memset(&when, 0, sizeof(when));
+	when.it_value.tv_sec = ms / 1000;
+	when.it_value.tv_nsec = (ms % 1000) * 1000000L;
+	if (timerfd_settime(timer, 0, &when, NULL) == -1) {
+		LOG(1, "ERROR: Can't set a timer: %s", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/* Watch fd for writing too, or stop doing so */
+static void poll_device_out(int epoll_fd, int on)
+{
+	struct epoll_event event;
+
+	if (mark_polling == on)
+		return;
+	event.events = on ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+	event.data.fd = fd;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event) == -1) {
+		LOG(1, "ERROR: Can't watch the device: %s", strerror(errno));
+		return;
+	}
+	mark_polling = on;
+}
+
+/*
+  write_mark: tell Speakup the newest index mark reached. If the device
+  can't take it now, it is written when the device becomes writable,
+  unless a newer mark replaces it in the meantime. */
+
+static void write_mark(int epoll_fd)
+{
+	char buf[16];
+	int mark, len;
+
+	mark = __atomic_exchange_n(&mark_waiting, -1, __ATOMIC_ACQUIRE);
+	if (mark != -1)
+		mark_unwritten = mark;
+	if (mark_unwritten == -1) {
+		poll_device_out(epoll_fd, 0);
+		return;
+	}
+
+	len = snprintf(buf, sizeof(buf), "%d", mark_unwritten);
+	if (write(fd, buf, len) < 0) {
+		if (errno == EAGAIN) {
+			poll_device_out(epoll_fd, 1);
+			return;
+		}
+		LOG(1, "Unable to write index mark: %s", strerror(errno));
 	} else {
-		*out_p = 0;
-		LOG(5, "Recoded text: |%s|", utf8_text);
+		LOG(5, "Index mark %s written", buf);
 	}
+	mark_unwritten = -1;
+	poll_device_out(epoll_fd, 0);
+}
+
+static void wake_dispatcher(void)
+{
+	char c = 0;
 
-	iconv_close(cd);
+	/* A full pipe already holds enough wake-ups */
+	if (write(wake_pipe[1], &c, 1) < 0 && errno != EAGAIN)
+		LOG(1, "ERROR: Can't wake the dispatcher up: %s",
+		    strerror(errno));
+}
 
-	return utf8_text;
+static void queue_event(struct event *event)
+{
+	if (queue_push(&events, event)) {
+		/* A reset mustn't be lost, it is done as for SIGHUP */
+		if (event->type == EVENT_RESET) {
+			__atomic_store_n(&reset_requested, 1,
+					 __ATOMIC_RELEASE);
+			wake_dispatcher();
+			return;
+		}
+		LOG(1, "ERROR: Speech Dispatcher is too slow, dropping text");
+		free(event->text);
+		return;
+	}
+	wake_dispatcher();
+}
+
+static int hold_event(const struct event *event)
+{
+	struct event *new_held;
+	size_t new_size;
+
+	if (n_held == held_size) {
+		new_size = held_size ? 2 * held_size : 8;
+		new_held = realloc(held, new_size * sizeof(*held));
+		if (new_held == NULL)
+			return -1;
+		held = new_held;
+		held_size = new_size;
+	}
+	held[n_held++] = *event;
+	return 0;
+}
+
+/* Pass what was held on to the dispatcher */
+static void release_held(void)
+{
+	size_t i;
+
+	for (i = 0; i < n_held; i++)
+		queue_event(&held[i]);
+	n_held = 0;
+	navigating = 0;
+}
+
+static void drop_held(void)
+{
+	size_t i;
+
+	for (i = 0; i < n_held; i++)
+		free(held[i].text);
+	if (n_held > 0)
+		LOG(5, "Dropping %d held events", (int)n_held);
+	n_held = 0;
 }
 
 /*
-  speak_string: send a string containing more than one printable character 
-  to Speech Dispatcher.  */
+  debounce_stop: called for each stop. If the previous stop came less
+  than NavigationDebounce ago, hold what follows until there has been
+  no stop for that long. */
 
-int speak_string(char *text)
+static void debounce_stop(void)
 {
-	char *utf8_text = NULL;
-	char *ssml_text = NULL;
-	int ret = 0;
-	utf8_text = recode_text(text);
-	if (utf8_text == NULL)
-		ret = -1;
-	else {
-		int bufsize = strlen(utf8_text) + 16;
-		ssml_text = malloc(bufsize);
-		if (ssml_text == NULL)
-			ret = -1;
-		else {
-			snprintf(ssml_text, bufsize,
-				 "<speak>%s</speak>", utf8_text);
-			LOG(5, "Sending to speechd as text: |%s|", ssml_text);
-			ret = spd_say(conn, SPD_MESSAGE, ssml_text);
-		}
-	}
-	xfree(utf8_text);
-	xfree(ssml_text);
-	return ret;
+	static struct timespec last_stop;
+	struct timespec now;
+	long since;
+
+	if (debounce_timer < 0)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	since = (now.tv_sec - last_stop.tv_sec) * 1000
+	    + (now.tv_nsec - last_stop.tv_nsec) / 1000000;
+	last_stop = now;
+
+	if (!navigating && since >= options.navigation_debounce)
+		return;
+	if (arm_timer(debounce_timer, options.navigation_debounce) == 0)
+		navigating = 1;
 }
 
-int speak(char *text)
+/*
+  dispatch: queue an event for the dispatcher thread, with a copy of
+  len bytes of text for EVENT_TEXT. */
+
+void dispatch(enum event_type type, const char *text, size_t len,
+	      const struct voice_state *voice)
 {
-	/* Check whether text contains more than one
-	   printable character. If so, use spd_say,
-	   otherwise use say_single_character.
+	struct event event;
+
+	event.type = type;
+	event.stops = stops_requested;
+	event.voice = (voice != NULL) ? *voice : voice_unset;
+	event.text = NULL;
+	event.skipped = 0;
+	if (text != NULL) {
+		event.text = malloc(len + 1);
+		if (event.text == NULL) {
+			LOG(1, "ERROR: Can't allocate text: %s",
+			    strerror(errno));
+			return;
+		}
+		memcpy(event.text, text, len);
+		event.text[len] = 0;
+	}
 
-	   Returns 0 on success, -2 on speechd communication
-	   errors, -1 on other errors.
-	 */
+	/* Only text waits, a reset held would be lost to the next stop */
+	if (navigating && type == EVENT_TEXT && hold_event(&event) == 0)
+		return;
+	queue_event(&event);
+}
+
+/*
+  chunk_end: the length of the first piece of text to send on its own,
+  or 0 to send it whole. Pieces end after the white space following
+  the end of a sentence, or if there is none soon enough, the end of a
+  clause, and are at least ChunkSize bytes long. Index marks never
+  contain white space, so they stay whole. */
+
+static size_t chunk_end(const char *text, size_t len)
+{
+	size_t i, clause = 0;
+	size_t max = 4 * options.chunk_size;
+
+	for (i = options.chunk_size; i + 1 < len; i++) {
+		if (!isspace((unsigned char)text[i]))
+			continue;
+		switch (text[i - 1]) {
+		case '.':
+		case '!':
+		case '?':
+			return i + 1;
+		case ',':
+		case ';':
+		case ':':
+			clause = i + 1;
+			break;
+		}
+		if (i >= max && clause > 0)
+			return clause;
+	}
+	return 0;
+}
+
+/*
+  prosody_scan: update carry with the InlineProsody changes in text, so
+  that it holds those in effect at its end. */
+
+static void prosody_scan(const char *text, size_t len,
+			 struct prosody_carry *carry)
+{
+	const char *p, *end = text + len;
+	char *q;
+	long val;
+
+	if (!options.inline_prosody)
+		return;
+	for (p = memchr(text, RECODE_MARK, len); p != NULL;
+	     p = memchr(p, RECODE_MARK, end - p)) {
+		p++;
+		val = strtol(p, &q, 10);
+		if (q == end)
+			break;
+		if (*q == 's')
+			carry->rate = val;
+		else if (*q == 'p')
+			carry->pitch = val;
+		p = q;
+	}
+}
+
+/* Write the marks for the changes in carry, at most 2 * PROSODY_MARK_LEN
+   bytes, to buf. Returns their length. */
+static size_t prosody_marks(char *buf, const struct prosody_carry *carry)
+{
+	size_t n = 0;
 
+	if (carry->rate != 0)
+		n += sprintf(buf + n, "%c%ds", RECODE_MARK, carry->rate);
+	if (carry->pitch != 0)
+		n += sprintf(buf + n, "%c%dp", RECODE_MARK, carry->pitch);
+	return n;
+}
+
+/* Dispatch text with the prosody changes in carry put in front of it */
+static void dispatch_carried(const char *text, size_t len,
+			     const struct voice_state *voice,
+			     const struct prosody_carry *carry)
+{
+	char *piece;
+	size_t n;
+
+	if (carry->rate == 0 && carry->pitch == 0) {
+		dispatch(EVENT_TEXT, text, len, voice);
+		return;
+	}
+	piece = malloc(len + 2 * PROSODY_MARK_LEN);
+	if (piece == NULL) {
+		LOG(1, "ERROR: Can't allocate text: %s", strerror(errno));
+		return;
+	}
+	n = prosody_marks(piece, carry);
+	memcpy(piece + n, text, len);
+	dispatch(EVENT_TEXT, piece, n + len, voice);
+	free(piece);
+}
+
+/*
+  dispatch_text: dispatch text, in several messages if ChunkSize says
+  so. Each piece starts with the prosody changes made before it, as
+  every message starts with the voice it is sent with; carry holds
+  those made before text itself. */
+
+static void dispatch_text(const char *text, size_t len,
+			  const struct voice_state *voice,
+			  struct prosody_carry carry)
+{
+	size_t n;
+
+	if (options.chunk_size > 0)
+		while (len > options.chunk_size
+		       && (n = chunk_end(text, len)) > 0) {
+			dispatch_carried(text, n, voice, &carry);
+			prosody_scan(text, n, &carry);
+			text += n;
+			len -= n;
+		}
+	dispatch_carried(text, len, voice, &carry);
+}
+
+/* Append bytes to the pending text, growing the buffer as needed */
+static int text_append(const char *bytes, size_t len)
+{
+	char *new_text;
+	size_t new_size;
+
+	if (parser.text_len == 0)
+		parser.voice = voice_wanted;
+
+	if (parser.text_len + len + 1 > parser.text_size) {
+		new_size = 2 * (parser.text_len + len + 1);
+		new_text = realloc(parser.text, new_size);
+		if (new_text == NULL) {
+			LOG(1, "ERROR: Can't allocate text buffer: %s",
+			    strerror(errno));
+			return -1;
+		}
+		parser.text = new_text;
+		parser.text_size = new_size;
+	}
+	memcpy(parser.text + parser.text_len, bytes, len);
+	parser.text_len += len;
+	parser.text[parser.text_len] = 0;
+	return 0;
+}
+
+static void text_clear(void)
+{
+	parser.text_len = 0;
+	parser.text_chars = 0;
+	if (parser.text != NULL)
+		parser.text[0] = 0;
+}
+
+/*
+  new_suffix: with SpeakNewSuffix, if text is the last text dispatched
+  with something added, return where the word with the new part
+  starts. Otherwise return 0. */
+
+static size_t new_suffix(const char *text, size_t len,
+			 const struct voice_state *voice)
+{
+	size_t start;
+
+	if (!options.speak_new_suffix || parser.after_stop
+	    || last_said.len == 0 || len <= last_said.len
+	    || memcmp(voice, &last_said.voice, sizeof(*voice))
+	    || memcmp(text, last_said.text, last_said.len))
+		return 0;
+
+	/* Say the whole word which grew. White space never occurs inside
+	   a character or a mark, so they are not cut either. */
+	start = last_said.len;
+	if (!isspace((unsigned char)text[start]))
+		while (start > 0 && !isspace((unsigned char)text[start - 1]))
+			start--;
+	LOG(5, "Saying only the new part from byte %d", (int)start);
+	return start;
+}
+
+/* Whether text has just one printable character, counted as speak()
+   does, which is said as a character rather than as a text */
+static int one_character(const char *text, size_t len)
+{
+	size_t i;
 	int printables = 0;
-	int i;
-	char *utf8_text = NULL;
-	int spd_ret = 0, ret = 0;
-	char character[2];
 
-	assert(text);
-	for (i = 0; i <= strlen(text) - 1; i++) {
-		if (!isspace(text[i])) {
-			if (printables == 0)
-				sprintf(character, "%c", text[i]);
+	for (i = 0; i < len && printables < 2; i++)
+		if (!(utf8_input && (text[i] & 0xc0) == 0x80)
+		    && !isspace((unsigned char)text[i]))
 			printables++;
+	return printables == 1;
+}
+
+static void remember_said(const char *text, size_t len,
+			  const struct voice_state *voice)
+{
+	char *new_text;
+
+	if (!options.speak_new_suffix)
+		return;
+	if (len > last_said.size) {
+		new_text = realloc(last_said.text, len);
+		if (new_text == NULL) {
+			last_said.len = 0;
+			return;
 		}
+		last_said.text = new_text;
+		last_said.size = len;
 	}
+	memcpy(last_said.text, text, len);
+	last_said.len = len;
+	last_said.voice = *voice;
+}
 
-	LOG(5, "Text before recoding: |%s|", text);
+/*
+  parse_flush: say the text collected so far. It is called before
+  commands and whenever there is no more input available for now. */
 
-	if (printables == 1 && !isupper(*character)) {
-		utf8_text = recode_text(character);
-		LOG(5, "Sending to speechd as character: |%s|", utf8_text);
-		spd_ret = say_single_character(utf8_text);
-	} else if (printables >= 1) {
-		spd_ret = speak_string(text);
+void parse_flush(void)
+{
+	size_t complete, n, start;
+	const char *said;
+	struct prosody_carry carry;
+	char tail[4];
+
+	/* Whatever the timer was armed for is said now */
+	if (flush_armed) {
+		arm_timer(flush_timer, 0);
+		flush_armed = 0;
 	}
-	/* Else printables is 0, nothing to do. */
 
-	if (spd_ret != 0)
-		ret = -2;
-	xfree(utf8_text);
-	return ret;
+	if (parser.text_chars == 0) {
+		text_clear();
+		return;
+	}
+
+	/* Keep a character whose last bytes haven't arrived yet */
+	complete = recode_complete(parser.text, parser.text_len);
+	assert(parser.text_len - complete < sizeof(tail));
+	memcpy(tail, parser.text + complete, parser.text_len - complete);
+	parser.text[complete] = 0;
+
+	if (complete > 0) {
+		LOG(5, "text: |%s %d|", parser.text, parser.text_chars);
+		n = complete;
+		if (normalize_enabled())
+			n = normalize(parser.text, complete, utf8_input);
+		said = parser.text;
+		if (substitute_enabled())
+			said = substitute(parser.text, n, &n);
+		/* What comes right after a stop was asked for by the user,
+		   it is said even if it was said just before. So is a
+		   single character, which is mostly a key typed. */
+		if (options.suppress_repeats > 0 && !one_character(said, n)
+		    && repeat_seen(said, n, &parser.voice, parser.after_stop))
+			n = 0;
+		if (n > 0) {
+			start = new_suffix(said, n, &parser.voice);
+			carry.rate = carry.pitch = 0;
+			prosody_scan(said, start, &carry);
+			dispatch_text(said + start, n - start, &parser.voice,
+				      carry);
+			remember_said(said, n, &parser.voice);
+		}
+		parser.after_stop = 0;
+	}
+
+	n = parser.text_len - complete;
+	text_clear();
+	if (n > 0) {
+		text_append(tail, n);
+		parser.text_chars = n;
+	}
 }
 
-int parse_buf(char *buf, size_t bytes)
+/*
+  flush_words: say the pending text up to its last white space, and
+  keep the word it ends with, or say all of it if it has no white
+  space. The word is kept with the voice of the text, and the prosody
+  changes made before it. */
+
+static void flush_words(void)
+{
+	struct voice_state voice = parser.voice;
+	struct prosody_carry carry = { 0, 0 };
+	char *word;
+	size_t cut, len, i;
+	int chars = 0;
+
+	for (cut = parser.text_len; cut > 0; cut--)
+		if (isspace((unsigned char)parser.text[cut - 1]))
+			break;
+	if (cut == 0 || cut == parser.text_len) {
+		parse_flush();
+		return;
+	}
+
+	len = parser.text_len - cut;
+	word = malloc(len + 2 * PROSODY_MARK_LEN);
+	if (word == NULL) {
+		parse_flush();
+		return;
+	}
+	prosody_scan(parser.text, cut, &carry);
+	i = prosody_marks(word, &carry);
+	memcpy(word + i, parser.text + cut, len);
+	len += i;
+
+	/* Marks don't count as text */
+	for (i = 0; i < len; i++) {
+		if (word[i] != RECODE_MARK) {
+			chars++;
+			continue;
+		}
+		while (i + 1 < len
+		       && (isdigit((unsigned char)word[i + 1])
+			   || word[i + 1] == '-'))
+			i++;
+		i++;
+	}
+
+	parser.text_len = cut;
+	parser.text[cut] = 0;
+	parse_flush();
+	text_append(word, len);
+	parser.voice = voice;
+	parser.text_chars = chars;
+	free(word);
+}
+
+/*
+  hold_text: say the text at the end of what was read later, so that a
+  line arriving in several reads is said as one message. Each piece of
+  it waits FlushDelay for the next one, but the text is held for
+  FLUSH_HOLD_MAX FlushDelays at most. */
+
+void hold_text(void)
+{
+	struct timespec now;
+	long held, left;
+
+	if (options.flush_delay == 0 || flush_timer < 0) {
+		parse_flush();
+		return;
+	}
+	if (parser.text_chars == 0)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (!flush_armed)
+		flush_since = now;
+	held = (now.tv_sec - flush_since.tv_sec) * 1000
+	    + (now.tv_nsec - flush_since.tv_nsec) / 1000000;
+	left = FLUSH_HOLD_MAX * options.flush_delay - held;
+	flush_forced = (left <= options.flush_delay);
+	if (left < 1)
+		left = 1;
+
+	if (arm_timer(flush_timer,
+		      flush_forced ? left : options.flush_delay)) {
+		parse_flush();
+		return;
+	}
+	flush_armed = 1;
+}
+
+/*
+  flush_timeout: the flush timer fired. After a pause in the input all
+  the text is said, but text held for too long is said only up to its
+  last word, which waits for the rest of it once more. */
+
+void flush_timeout(void)
+{
+	if (!flush_forced) {
+		parse_flush();
+		return;
+	}
+	flush_words();
+	hold_text();
+}
+
+/* Relative change of a voice setting against the start of the text */
+static int prosody_change(int start, int now)
+{
+	return now - ((start == VOICE_UNSET) ? 0 : start);
+}
+
+static void parse_command(void)
 {
 	char helper[20];
-	char cmd_type = ' ';
-	int n, m;
-	int current_char;
-	unsigned int param;
-	int pm;
 
-	int i;
-	//char *mark_tag="<mark name=\"%s\">";
-	char *pi, *po;
-	static char text[BUF_SIZE * 16];	/* Definitely big enough. */
+	if (parser.skipping) {
+		/* Only settings still matter for what follows the stop */
+		if (parser.cmd_type != 'i')
+			process_command(parser.cmd_type, parser.param,
+					parser.pm);
+		return;
+	}
 
-	assert(bytes <= BUF_SIZE);
+	if (parser.cmd_type == 'i') {
+		LOG(5, "Insert Index %d", parser.param);
+		sprintf(helper, "%c%di", RECODE_MARK, parser.param);
+		text_append(helper, strlen(helper));
+	} else if (options.inline_prosody && parser.text_chars != 0
+		   && (parser.cmd_type == 's' || parser.cmd_type == 'p')) {
+		/* Change the voice in the middle of the text */
+		process_command(parser.cmd_type, parser.param, parser.pm);
+		if (parser.cmd_type == 's')
+			sprintf(helper, "%c%ds", RECODE_MARK,
+				prosody_change(parser.voice.rate,
+					       voice_wanted.rate));
+		else
+			sprintf(helper, "%c%dp", RECODE_MARK,
+				prosody_change(parser.voice.pitch,
+					       voice_wanted.pitch));
+		text_append(helper, strlen(helper));
+	} else {
+		/* If there is some text before this command, say it */
+		parse_flush();
+		/* Now when we have the command (cmd_type) and it's
+		   parameter, let's communicate it to speechd */
+		process_command(parser.cmd_type, parser.param, parser.pm);
+	}
+}
 
-	param = 0;
-	pi = buf;
-	po = text;
-	m = 0;
+/*
+  text_cut: how much of a run of text to add to the pending text when
+  only room bytes fit. It is cut after its last white space there, or
+  if there is none, the pending text is said on its own first unless
+  it is short, so that the run isn't cut inside a word without need. */
+
+static size_t text_cut(const char *run, size_t room)
+{
+	size_t n = room;
 
-	for (i = 0; i < bytes; i++) {
-		/* Stop speaking */
+	while (n > 0 && !isspace((unsigned char)run[n - 1]))
+		n--;
+	if (n > 0)
+		return n;
+	return (parser.text_len > TEXT_MAX / 2) ? 0 : room;
+}
+
+/*
+  parse_buf: feed a piece of Speakup's output to the parser. The input
+  doesn't need to end at any particular place, the parser remembers
+  unfinished commands and text until more input arrives. */
+
+int parse_buf(const char *buf, size_t bytes)
+{
+	size_t i = 0, n;
+
+	while (i < bytes) {
+		/* Stop speaking, even in the middle of a command */
 		if (buf[i] == DTLK_STOP) {
-			spd_cancel(conn);
-			LOG(5, "[stop]");
-			pi = &(buf[i + 1]);
-			po = text;
-			m = 0;
+			if (!parser.skipping) {
+				__atomic_store_n(&stops_requested,
+						 stops_requested + 1,
+						 __ATOMIC_RELEASE);
+				wake_dispatcher();
+				LOG(5, "[stop]");
+				drop_held();
+				debounce_stop();
+			}
+			text_clear();
+			parser.state = PARSE_TEXT;
+			parser.after_stop = 1;
+			i++;
+			continue;
 		}
 
-		/* Process a command */
-		else if (buf[i] == DTLK_CMD) {
+		switch (parser.state) {
+		case PARSE_TEXT:
+			if (buf[i] == DTLK_CMD) {
+				parser.state = PARSE_SIGN;
+				parser.cmd_type = ' ';
+				i++;
+				break;
+			}
+			/* This is ordinary text, so put it into our text
+			   buffer for later synthesis, up to the next control
+			   byte. It is recoded and escaped only once the whole
+			   utterance is known. */
+			n = scan(&control_bytes, &buf[i], bytes - i);
+			if (parser.skipping) {
+				i += n;
+				break;
+			}
+			if (parser.text_len + n > TEXT_MAX) {
+				/* Say what fits, the rest follows */
+				n = text_cut(&buf[i],
+					     TEXT_MAX - parser.text_len);
+				text_append(&buf[i], n);
+				parser.text_chars += n;
+				i += n;
+				parse_flush();
+				break;
+			}
+			text_append(&buf[i], n);
+			parser.text_chars += n;
+			i += n;
+			break;
+
+		case PARSE_SIGN:
 			/* If the digit is signed integer, read the sign.  We have
 			   to do it this way because +3, -3 and 3 seem to be three
 			   different things in this protocol */
-			i++;
 			if (buf[i] == '+')
-				i++, pm = 1;
+				i++, parser.pm = 1;
 			else if (buf[i] == '-')
-				i++, pm = -1;
+				i++, parser.pm = -1;
 			else
-				pm = 0;	/* No sign */
+				parser.pm = 0;	/* No sign */
+			parser.n_digits = 0;
+			parser.state = PARSE_DIGITS;
+			break;
 
+		case PARSE_DIGITS:
 			/* Read the numerical parameter (one or more digits) */
-			n = 0;
-			while (isdigit(buf[i]) && n < 15)
-				helper[n++] = buf[i++];
-			if (n) {
-				helper[n] = 0;
-				param = strtol(helper, NULL, 10);
-				cmd_type = buf[i];
-			}
-
-			if (cmd_type == 'i') {
-				LOG(5, "Insert Index %d", param);
-				sprintf(helper, "<mark name=\"%d\"/>", param);
-				strcpy(po, helper);
-				pi = &(buf[i + 1]);
-				po += strlen(helper) * sizeof(char);
-				*po = 0;
-			} else {
-				/* If there is some text before this command, say it */
-				if (m > 0) {
-					*po = '\0';
-					LOG(5, "text: |%s|", text);
-					LOG(5, "[speaking (2)]");
-					speak(text);
-					m = 0;
-				}
-				/* Now when we have the command (cmd_type) and it's
-				   parameter, let's communicate it to speechd */
-				process_command(cmd_type, param, pm);
-				pi = &(buf[i + 1]);
-				po = text;
+			if (isdigit((unsigned char)buf[i])
+			    && parser.n_digits < 15) {
+				parser.digits[parser.n_digits++] = buf[i++];
+				break;
 			}
-		} else {
-			/* This is ordinary text, so put the byte into our text
-			   buffer for later synthesis. */
-			m++;
-			current_char = *pi;
-			if (isascii(current_char)
-			    && (ssml_entities[current_char] != NULL)) {
-				strcpy(po, ssml_entities[current_char]);
-				po += ssml_entity_lengths[current_char];
-			} else {
-				*po = *pi;
-				po += sizeof(char);
+			if (parser.n_digits) {
+				parser.digits[parser.n_digits] = 0;
+				parser.param = strtol(parser.digits, NULL, 10);
+				parser.cmd_type = buf[i];
 			}
-			pi += sizeof(char);
+			i++;
+			parser.state = PARSE_TEXT;
+			parse_command();
+			break;
 		}
 	}
-	*po = 0;
 
-	/* Finally, say the text we read from /dev/softsynth */
-	assert(m >= 0);
+	return 0;
+}
+
+/*
+  parse_input: parse everything read from Speakup so far. Text before
+  the last stop in it would only be cancelled right after being sent,
+  so it is skipped, and of the commands there only the settings are
+  applied. */
 
-	if (m != 0) {
-		LOG(5, "text: |%s %d|", text, m);
-		LOG(5, "[speaking]");
-		speak(text);
-		LOG(5, "---");
+void parse_input(struct ring *input)
+{
+	const char *data;
+	size_t len;
+	ssize_t skip;
+
+	skip = ring_rfind(input, DTLK_STOP);
+	if (skip > 0)
+		LOG(5, "Skipping %d bytes before a stop", (int)skip);
+
+	while (input->len > 0) {
+		data = ring_peek(input, &len);
+		parser.skipping = (skip > 0);
+		if (skip > 0 && len > skip)
+			len = skip;
+		parse_buf(data, len);
+		ring_consume(input, len);
+		skip -= len;
 	}
+	parser.skipping = 0;
+}
 
-	return 0;
+/* Add the socket of a native SSIP connection to the sets to watch */
+static void watch_connection(struct connection *c, fd_set *read_set,
+			     fd_set *write_set, int *max_fd)
+{
+	int sock = conn_fd(c);
+
+	if (sock < 0)
+		return;
+	FD_SET(sock, read_set);
+	if (conn_want_write(c))
+		FD_SET(sock, write_set);
+	if (sock > *max_fd)
+		*max_fd = sock;
 }
 
-void spd_spk_terminate(int sig)
+static void service_connection(struct connection *c, fd_set *read_set,
+			       fd_set *write_set)
+{
+	int sock = conn_fd(c);
+
+	if (sock < 0)
+		return;
+	if (!FD_ISSET(sock, read_set) && !FD_ISSET(sock, write_set))
+		return;
+	if (conn_process(c)) {
+		LOG(1, "Connection to Speech Dispatcher lost, reconnecting");
+		connection_lost();
+	}
+}
+
+/*
+  adapt_rate: with AdaptiveRate, speak faster the more messages are
+  waiting to be said, on top of the rate set in Speakup. */
+
+static void adapt_rate(struct voice_state *voice)
+{
+	int waiting, boost, rate;
+
+	if (options.adaptive_rate == 0)
+		return;
+
+	waiting = conn_backlog(&conn) + n_backlog;
+	boost = options.adaptive_rate * waiting;
+	if (boost > options.adaptive_rate_max)
+		boost = options.adaptive_rate_max;
+
+	/* Leave the rate of Speech Dispatcher alone until needed */
+	if (voice->rate == VOICE_UNSET) {
+		if (boost == 0 && conn.voice.rate == VOICE_UNSET)
+			return;
+		rate = 0;
+	} else
+		rate = voice->rate;
+
+	if (boost > 0)
+		LOG(5, "[rate raised by %d, %d messages waiting]", boost,
+		    waiting);
+	rate += boost;
+	voice->rate = (rate > 100) ? 100 : rate;
+}
+
+/* Keep a message until Speech Dispatcher can be reached again */
+static void outage_add(struct event *event)
+{
+	if (options.outage_buffer == 0) {
+		free(event->text);
+		return;
+	}
+	if (n_outage == options.outage_buffer) {
+		free(outage[0].text);
+		n_outage--;
+		memmove(outage, outage + 1, n_outage * sizeof(*outage));
+	}
+	outage[n_outage++] = *event;
+}
+
+static void outage_drop(void)
+{
+	size_t i;
+
+	for (i = 0; i < n_outage; i++)
+		free(outage[i].text);
+	n_outage = 0;
+}
+
+static void say_event(struct event *event)
+{
+	struct voice_state voice = event->voice;
+
+	if (!connected) {
+		outage_add(event);
+		return;
+	}
+
+	adapt_rate(&voice);
+	LOG(5, "[speaking]");
+	if (speak(event->text, &voice) == -2) {
+		LOG(1, "ERROR: Can't send to Speech Dispatcher, reconnecting");
+		connection_lost();
+		/* What failed again after reconnecting is not tried
+		   once more */
+		if (!replaying) {
+			outage_add(event);
+			return;
+		}
+	}
+	LOG(5, "---");
+	free(event->text);
+}
+
+/* Number of lines in text, not counting an empty last one */
+static size_t count_lines(const char *text)
+{
+	size_t lines = 1;
+
+	for (; *text != 0; text++)
+		if (*text == '\n' && text[1] != 0)
+			lines++;
+	return lines;
+}
+
+/* Forget the n oldest held messages */
+static void backlog_drop(size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		backlog_bytes -= strlen(backlog[i].text);
+		free(backlog[i].text);
+	}
+	n_backlog -= n;
+	memmove(backlog, backlog + n, n_backlog * sizeof(*backlog));
+}
+
+/*
+  backlog_flood: make room in the backlog according to FloodPolicy. */
+
+static void backlog_flood(void)
+{
+	struct event summary;
+	size_t i, n, lines, len;
+
+	LOG(3, "Flood: %d messages (%d bytes) held, %d at Speech Dispatcher",
+	    (int)n_backlog, (int)backlog_bytes, conn_backlog(&conn));
+
+	switch (options.flood_policy) {
+	case FLOOD_OLDEST:
+		backlog_drop(n_backlog - options.flood_limit);
+		break;
+
+	case FLOOD_LAST:
+		/* Keep the newest messages which have FloodLines lines
+		   together, but never more than FloodLimit of them */
+		lines = 0;
+		for (n = n_backlog; n > 0 && lines < options.flood_lines; n--)
+			lines += count_lines(backlog[n - 1].text);
+		if (n < n_backlog - options.flood_limit)
+			n = n_backlog - options.flood_limit;
+		backlog_drop(n);
+		break;
+
+	case FLOOD_SUMMARY:
+		/* Say how much was left out, then the newest message */
+		n = n_backlog - 1;
+		lines = 0;
+		for (i = 0; i < n; i++)
+			lines += backlog[i].skipped ? backlog[i].skipped
+			    : count_lines(backlog[i].text);
+		backlog_drop(n);
+		/* FloodSummary has just one %d, the configuration checks */
+		len = strlen(options.flood_summary) + 3 * sizeof(int);
+		summary = backlog[0];
+		summary.text = malloc(len);
+		if (summary.text == NULL)
+			break;
+		snprintf(summary.text, len, options.flood_summary,
+			 (int)lines);
+		summary.skipped = lines;
+		LOG(5, "Flood summary: |%s|", summary.text);
+		memmove(backlog + 1, backlog, n_backlog * sizeof(*backlog));
+		backlog[0] = summary;
+		n_backlog++;
+		backlog_bytes += strlen(summary.text);
+		break;
+	}
+}
+
+static void backlog_add(struct event *event)
+{
+	backlog[n_backlog++] = *event;
+	backlog_bytes += strlen(event->text);
+	if (n_backlog > options.flood_limit)
+		backlog_flood();
+}
+
+/* Pass on held messages while Speech Dispatcher has room for them */
+static void backlog_send(void)
+{
+	struct event event;
+
+	while (connected && n_backlog > 0
+	       && conn_backlog(&conn) < options.flood_backlog) {
+		event = backlog[0];
+		backlog_bytes -= strlen(event.text);
+		n_backlog--;
+		memmove(backlog, backlog + 1, n_backlog * sizeof(*backlog));
+		say_event(&event);
+	}
+}
+
+/* Cancel the speech if the reader saw DTLK_STOP since the last time */
+static void dispatch_stops(void)
+{
+	unsigned int stops;
+
+	stops = __atomic_load_n(&stops_requested, __ATOMIC_ACQUIRE);
+	if (stops == stops_handled)
+		return;
+	/* Speakup stops on almost every key, mostly when there is
+	   nothing to stop */
+	if (!connected) {
+		outage_drop();
+	} else {
+		if (!conn_idle(&conn))
+			conn_cancel(&conn);
+		else
+			LOG(5, "Nothing to cancel");
+		/* The echo of typing is stopped as well */
+		if (options.separate_echo && !conn_idle(&echo_conn))
+			conn_cancel(&echo_conn);
+	}
+	stops_handled = stops;
+
+	/* All that is held came before the stop */
+	if (n_backlog > 0)
+		backlog_drop(n_backlog);
+}
+
+/* Say what was kept while Speech Dispatcher couldn't be reached */
+static void outage_replay(void)
+{
+	size_t i;
+
+	replaying = 1;
+	for (i = 0; i < n_outage && connected; i++) {
+		if (options.flood_policy != FLOOD_NONE)
+			backlog_add(&outage[i]);
+		else
+			say_event(&outage[i]);
+	}
+	replaying = 0;
+	n_outage -= i;
+	memmove(outage, outage + i, n_outage * sizeof(*outage));
+}
+
+/*
+  reconnect: connect to Speech Dispatcher again if it is time to try,
+  and say what was kept meanwhile. */
+
+static void reconnect(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (now.tv_sec < reconnect_at.tv_sec
+	    || (now.tv_sec == reconnect_at.tv_sec
+		&& now.tv_nsec < reconnect_at.tv_nsec))
+		return;
+
+	if (open_connections(&conn, &echo_conn)) {
+		LOG(3, "Can't connect to Speech Dispatcher, trying again "
+		    "in %d ms", reconnect_delay);
+		reconnect_later(reconnect_delay);
+		reconnect_delay *= 2;
+		if (reconnect_delay > RECONNECT_MAX_DELAY)
+			reconnect_delay = RECONNECT_MAX_DELAY;
+		return;
+	}
+
+	LOG(1, "Connected to Speech Dispatcher, %d messages kept",
+	    (int)n_outage);
+	connected = 1;
+	reconnect_delay = RECONNECT_MIN_DELAY;
+	conn_sync_voice(&conn, &lost_voice);
+	if (options.separate_echo)
+		conn_sync_voice(&echo_conn, &lost_echo_voice);
+	outage_replay();
+	start_standby();
+}
+
+/* How long the dispatcher may sleep before it must try to reconnect */
+static struct timeval *reconnect_timeout(struct timeval *timeout)
+{
+	struct timespec now;
+	long long ms;
+
+	if (connected)
+		return NULL;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = (reconnect_at.tv_sec - now.tv_sec) * 1000LL
+	    + (reconnect_at.tv_nsec - now.tv_nsec) / 1000000;
+	if (ms < 0)
+		ms = 0;
+	timeout->tv_sec = ms / 1000;
+	timeout->tv_usec = (ms % 1000) * 1000 + 1000;
+	return timeout;
+}
+
+static void dispatch_events(void)
+{
+	struct event event;
+
+	if (__atomic_exchange_n(&reset_requested, 0, __ATOMIC_ACQ_REL))
+		speechd_reset();
+	if (!connected)
+		reconnect();
+
+	dispatch_stops();
+	while (queue_pop(&events, &event) == 0) {
+		dispatch_stops();
+		switch (event.type) {
+		case EVENT_TEXT:
+			/* Text which came before a stop isn't wanted */
+			if (event.stops != stops_handled)
+				free(event.text);
+			else if (options.flood_policy != FLOOD_NONE)
+				backlog_add(&event);
+			else
+				say_event(&event);
+			break;
+		case EVENT_RESET:
+			LOG(5, "resetting speech dispatcher connection");
+			speechd_reset();
+			break;
+		}
+	}
+
+	if (options.flood_policy != FLOOD_NONE)
+		backlog_send();
+}
+
+/*
+  dispatcher: the thread which owns the connections to Speech
+  Dispatcher. It sleeps until the main thread queues something or,
+  with the native SSIP client, the server talks to us. */
+
+static void *dispatcher(void *arg)
+{
+	fd_set read_set, write_set;
+	struct timeval timeout;
+	char buf[64];
+	int max_fd;
+
+	while (1) {
+		if (__atomic_load_n(&terminate_requested, __ATOMIC_ACQUIRE))
+			break;
+		dispatch_events();
+
+		FD_ZERO(&read_set);
+		FD_ZERO(&write_set);
+		FD_SET(wake_pipe[0], &read_set);
+		max_fd = wake_pipe[0];
+		watch_connection(&conn, &read_set, &write_set, &max_fd);
+		if (options.separate_echo)
+			watch_connection(&echo_conn, &read_set, &write_set,
+					 &max_fd);
+
+		if (select(max_fd + 1, &read_set, &write_set, NULL,
+			   reconnect_timeout(&timeout)) < 0) {
+			if (errno == EINTR)
+				continue;
+			FATAL(5, "select() failed in the dispatcher");
+		}
+
+		if (FD_ISSET(wake_pipe[0], &read_set))
+			while (read(wake_pipe[0], buf, sizeof(buf)) > 0) ;
+
+		service_connection(&conn, &read_set, &write_set);
+		if (options.separate_echo)
+			service_connection(&echo_conn, &read_set, &write_set);
+	}
+	return NULL;
+}
+
+/*
+  start_dispatcher: create the dispatcher thread. Signals are left to
+  the main thread. */
+
+static void start_dispatcher(void)
+{
+	sigset_t all, old;
+
+	if (options.flood_policy != FLOOD_NONE) {
+		backlog = calloc(options.flood_limit + 1, sizeof(*backlog));
+		if (backlog == NULL)
+			FATAL(1, "Can't allocate the backlog");
+	}
+	if (options.outage_buffer > 0) {
+		outage = calloc(options.outage_buffer, sizeof(*outage));
+		if (outage == NULL)
+			FATAL(1, "Can't allocate the outage buffer");
+	}
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	if (pthread_create(&dispatcher_thread, NULL, dispatcher, NULL))
+		FATAL(1, "Can't start the dispatcher thread");
+	__atomic_store_n(&dispatcher_running, 1, __ATOMIC_RELEASE);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (connected)
+		start_standby();
+}
+
+static void terminate(void)
 {
 	LOG(1, "Terminating...");
-	/* TODO: Resolve race  */
 	speechd_close();
 	close(fd);
 	fclose(logfile);
 	exit(1);
 }
 
+void spd_spk_terminate(int sig)
+{
+	/* The connections belong to the dispatcher thread */
+	if (!__atomic_load_n(&dispatcher_running, __ATOMIC_ACQUIRE))
+		terminate();
+	if (eventfd_write(terminate_event, 1) < 0)
+		LOG(1, "ERROR: Can't wake the main loop up: %s",
+		    strerror(errno));
+}
+
+/* Stop the dispatcher thread, then terminate */
+static void stop_dispatcher(void)
+{
+	__atomic_store_n(&terminate_requested, 1, __ATOMIC_RELEASE);
+	wake_dispatcher();
+	pthread_join(dispatcher_thread, NULL);
+	__atomic_store_n(&dispatcher_running, 0, __ATOMIC_RELEASE);
+	terminate();
+}
+
 void spd_spk_reset(int sig)
 {
-	speechd_close();
-	speechd_init();
+	/* The connections belong to the dispatcher thread */
+	__atomic_store_n(&reset_requested, 1, __ATOMIC_RELEASE);
+	wake_dispatcher();
+}
+
+/*
+  select_speakup_device: prefer the UTF-8 device of newer kernels, unless
+  the user asked for a particular device or a unibyte encoding. */
+
+void select_speakup_device(void)
+{
+	if (options.speakup_device_set == DEFAULT
+	    && (options.speakup_coding_set == DEFAULT
+		|| recode_is_utf8(options.speakup_coding))
+	    && access(SOFTSYNTHU_DEVICE, R_OK) == 0) {
+		free(options.speakup_device);
+		options.speakup_device = strdup(SOFTSYNTHU_DEVICE);
+	}
+
+	/* Whatever the coding, this device always talks UTF-8 */
+	if (!strcmp(options.speakup_device, SOFTSYNTHU_DEVICE)
+	    && !recode_is_utf8(options.speakup_coding)) {
+		free(options.speakup_coding);
+		options.speakup_coding = strdup("utf-8");
+	}
+
+	utf8_input = recode_is_utf8(options.speakup_coding);
+	LOG(3, "Using device %s with %s encoding", options.speakup_device,
+	    options.speakup_coding);
 }
 
 int create_pid_file()
@@ -628,10 +2059,35 @@ void destroy_pid_file()
 	unlink(spd_spk_pid_file);
 }
 
+/*
+  read_speakup: read until Speakup has nothing more for us. Returns -1
+  on a read error. */
+
+int read_speakup(void)
+{
+	ssize_t chars_read;
+	size_t space;
+
+	do {
+		space = ring_space(&input);
+		chars_read = ring_read(&input, fd);
+		if (chars_read < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				break;
+			return -1;
+		}
+		LOG(5, "Main loop characters read = %d", (int)chars_read);
+		parse_input(&input);
+	} while (chars_read == space);
+	return 0;
+}
+
 int main(int argc, char *argv[])
 {
-	size_t chars_read;
-	char buf[BUF_SIZE + 1];
+	struct epoll_event event, ready[4];
+	uint64_t expirations;
+	int epoll_fd;
+	int i, n;
 	int ret;
 
 	options_set_default();
@@ -666,13 +2122,35 @@ int main(int argc, char *argv[])
 			return 1;
 	}
 
+	if (pipe(wake_pipe)
+	    || fcntl(wake_pipe[0], F_SETFL, O_NONBLOCK) == -1
+	    || fcntl(wake_pipe[1], F_SETFL, O_NONBLOCK) == -1) {
+		fprintf(stderr, "ERROR: Can't create a pipe: %s\n",
+			strerror(errno));
+		exit(1);
+	}
+	terminate_event = eventfd(0, EFD_NONBLOCK);
+	if (terminate_event == -1) {
+		fprintf(stderr, "ERROR: Can't create an eventfd: %s\n",
+			strerror(errno));
+		exit(1);
+	}
+
 	/* Register signals */
 	(void)signal(SIGINT, spd_spk_terminate);
 	(void)signal(SIGHUP, spd_spk_reset);
+	/* A connection which broke shows as a failed write */
+	(void)signal(SIGPIPE, SIG_IGN);
 
 	LOG(1, "Speechd-speakup starts!");
 
+	scan_init();
+	scan_set_init(&control_bytes, control_chars, 0);
+	if (ring_init(&input, INPUT_SIZE) || queue_init(&events, QUEUE_SIZE))
+		FATAL(1, "Can't allocate input buffer");
+
 	if (!options.probe_mode) {
+		select_speakup_device();
 		if ((fd = open(options.speakup_device, O_RDWR)) < 0) {
 			LOG(1,
 			    "Error while openning the device in read/write mode %d,%s",
@@ -699,6 +2177,13 @@ int main(int argc, char *argv[])
 			FATAL(5, "fcntl() failed");
 			return (-1);
 		}
+		if ((fcntl(fd, F_GETFL) & O_ACCMODE) == O_RDWR) {
+			mark_event = eventfd(0, EFD_NONBLOCK);
+			if (mark_event == -1)
+				LOG(1, "ERROR: Can't create an eventfd, not "
+				    "reporting index marks: %s",
+				    strerror(errno));
+		}
 	}
 
 	speechd_init();
@@ -707,22 +2192,14 @@ int main(int argc, char *argv[])
 		LOG(1,
 		    "This is just a probe mode. Not trying to read Speakup's device.\n");
 		LOG(1, "Trying to say something on Speech Dispatcher\n");
-		spd_say(conn, SPD_MESSAGE,
-			"Hello! It seems SpeechD-Up works correctly!\n");
+		conn_say(&conn, SPD_MESSAGE,
+			 "<speak>Hello! It seems SpeechD-Up works correctly!</speak>");
 		LOG(1, "Trying to close connection to Speech Dispatcher\n");
-		spd_close(conn);
+		speechd_close();
 		LOG(1, "SpeechD-Up is terminating correctly in probe mode");
 		return 0;
 	}
 
-	ret = spd_set_data_mode(conn, SPD_DATA_SSML);
-	if (ret) {
-		LOG(1,
-		    "ERROR: This version of Speech Dispatcher doesn't support SSML mode.\n"
-		    "Please use a newer version of Speech Dispatcher (at least 0.5)");
-		FATAL(6, "SSML not supported in Speech Dispatcher");
-	}
-
 	if (!options.dont_init_tables) {
 		ret = init_speakup_tables();
 		if (ret) {
@@ -738,26 +2215,86 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	epoll_fd = epoll_create1(0);
+	if (epoll_fd == -1)
+		FATAL(5, "epoll_create1() failed");
+	event.events = EPOLLIN;
+	event.data.fd = fd;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1)
+		FATAL(5, "epoll_ctl() failed");
+	if (mark_event != -1) {
+		event.data.fd = mark_event;
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, mark_event, &event)
+		    == -1)
+			FATAL(5, "epoll_ctl() failed");
+	}
+	event.data.fd = terminate_event;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, terminate_event, &event) == -1)
+		FATAL(5, "epoll_ctl() failed");
+
+	if (options.flush_delay > 0) {
+		flush_timer = add_timer(epoll_fd);
+		if (flush_timer == -1)
+			LOG(1, "ERROR: Can't create the flush timer, "
+			    "not delaying text: %s", strerror(errno));
+	}
+	if (options.navigation_debounce > 0) {
+		debounce_timer = add_timer(epoll_fd);
+		if (debounce_timer == -1)
+			LOG(1, "ERROR: Can't create the debounce timer, "
+			    "not debouncing: %s", strerror(errno));
+	}
+
+	start_dispatcher();
+
 	while (1) {
-		FD_ZERO(&fd_list);
-		FD_SET(fd, &fd_list);
-		if (select(fd + 1, &fd_list, NULL, NULL, NULL) < 0) {
+		n = epoll_wait(epoll_fd, ready, 4, -1);
+		if (n < 0) {
 			if (errno == EINTR)
 				continue;
-			FATAL(5, "select() failed");
+			FATAL(5, "epoll_wait() failed");
 			close(fd);
 			return -1;
 		}
-		chars_read = read(fd, buf, BUF_SIZE);
-		if (chars_read < 0) {
-			FATAL(5, "read() failed");
-			close(fd);
-			return -1;
+
+		for (i = 0; i < n; i++) {
+			if (ready[i].data.fd == terminate_event)
+				stop_dispatcher();
+			if (ready[i].data.fd == flush_timer) {
+				if (read(flush_timer, &expirations,
+					 sizeof(expirations)) < 0)
+					continue;
+				flush_armed = 0;
+				flush_timeout();
+				continue;
+			}
+			if (ready[i].data.fd == debounce_timer) {
+				if (read(debounce_timer, &expirations,
+					 sizeof(expirations)) < 0)
+					continue;
+				release_held();
+				continue;
+			}
+			if (ready[i].data.fd == mark_event) {
+				if (eventfd_read(mark_event, &expirations) < 0)
+					continue;
+				write_mark(epoll_fd);
+				continue;
+			}
+
+			if (ready[i].events & EPOLLOUT)
+				write_mark(epoll_fd);
+			if (!(ready[i].events & ~EPOLLOUT))
+				continue;
+
+			if (read_speakup()) {
+				FATAL(5, "read() failed");
+				close(fd);
+				return -1;
+			}
+			/* Say what's left over, unless more follows soon */
+			hold_text();
 		}
-		buf[chars_read] = 0;
-		LOG(5, "Main loop characters read = %d : (%s)", chars_read,
-		    buf);
-		parse_buf(buf, chars_read);
 	}
 
 	return 0;
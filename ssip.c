@@ -0,0 +1,462 @@
+/*
+ * ssip.c - Pipelined SSIP client
+ *
+ * Copyright (C) 2004, 2006, 2007 Brailcom, o.p.s.
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * Unlike libspeechd, this client doesn't wait for the reply to one
+ * command before sending the next one. Commands are written to the
+ * socket back to back, and replies are matched to them in order as
+ * they arrive, together with the events, whenever the main loop finds
+ * the socket readable. Failed commands can only be logged.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "log.h"
+#include "ssip.h"
+
+#define SSIP_DEFAULT_PORT "6560"
+#define SSIP_LINE_MAX 4096
+
+/* Most ms that closing may wait for the socket, writing or reading */
+#define SSIP_CLOSE_TIMEOUT 500
+
+/* A command still waiting for its reply */
+struct ssip_pending {
+	char command[32];	/* For error messages */
+	int message;		/* The reply tells the id of a message */
+};
+
+struct ssip {
+	int fd;
+	ssip_event_cb callback;
+
+	/* Written but not yet accepted by the socket */
+	char *out;
+	size_t out_len;
+	size_t out_size;
+
+	/* Commands sent, oldest first */
+	struct ssip_pending *pending;
+	size_t pending_head;
+	size_t pending_len;
+	size_t pending_size;
+
+	/* Incomplete line from the server */
+	char in[SSIP_LINE_MAX];
+	size_t in_len;
+
+	/* Parameters of the reply or event being received */
+	char params[3][64];
+	int n_params;
+};
+
+static int connect_unix(const char *path)
+{
+	struct sockaddr_un addr;
+	int sock;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		LOG(1, "ERROR: Socket path %s too long", path);
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock == -1)
+		return -1;
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		LOG(1, "ERROR: Can't connect to %s: %s", path,
+		    strerror(errno));
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+static int connect_inet(const char *host_port)
+{
+	struct addrinfo hints, *res, *ai;
+	char host[256];
+	const char *port = SSIP_DEFAULT_PORT, *colon;
+	int sock = -1;
+
+	colon = strchr(host_port, ':');
+	if (colon != NULL) {
+		snprintf(host, sizeof(host), "%.*s",
+			 (int)(colon - host_port), host_port);
+		port = colon + 1;
+	} else
+		snprintf(host, sizeof(host), "%s", host_port);
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, port, &hints, &res) != 0) {
+		LOG(1, "ERROR: Can't resolve %s", host);
+		return -1;
+	}
+	for (ai = res; ai != NULL; ai = ai->ai_next) {
+		sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (sock == -1)
+			continue;
+		if (connect(sock, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		close(sock);
+		sock = -1;
+	}
+	freeaddrinfo(res);
+	if (sock == -1)
+		LOG(1, "ERROR: Can't connect to %s:%s", host, port);
+	return sock;
+}
+
+/* Find Speech Dispatcher the same way libspeechd does */
+static int ssip_connect(void)
+{
+	const char *address = getenv("SPEECHD_ADDRESS");
+	const char *dir;
+	char path[256];
+
+	if (address != NULL && !strncmp(address, "inet_socket:", 12))
+		return connect_inet(address + 12);
+	if (address != NULL && !strncmp(address, "unix_socket:", 12))
+		return connect_unix(address + 12);
+
+	dir = getenv("XDG_RUNTIME_DIR");
+	if (dir != NULL)
+		snprintf(path, sizeof(path),
+			 "%s/speech-dispatcher/speechd.sock", dir);
+	else
+		snprintf(path, sizeof(path),
+			 "%s/.cache/speech-dispatcher/speechd.sock",
+			 getenv("HOME") ? getenv("HOME") : "");
+	return connect_unix(path);
+}
+
+struct ssip *ssip_open(const char *client_name, ssip_event_cb callback)
+{
+	struct ssip *ssip;
+
+	ssip = calloc(1, sizeof(*ssip));
+	if (ssip == NULL)
+		return NULL;
+	ssip->callback = callback;
+
+	ssip->fd = ssip_connect();
+	if (ssip->fd == -1) {
+		free(ssip);
+		return NULL;
+	}
+	fcntl(ssip->fd, F_SETFL, fcntl(ssip->fd, F_GETFL) | O_NONBLOCK);
+
+	ssip_command(ssip, "SET SELF CLIENT_NAME \"%s\"", client_name);
+	return ssip;
+}
+
+void ssip_close(struct ssip *ssip)
+{
+	struct timeval timeout = { SSIP_CLOSE_TIMEOUT / 1000,
+		(SSIP_CLOSE_TIMEOUT % 1000) * 1000
+	};
+	char buf[256];
+
+	if (ssip == NULL)
+		return;
+
+	/* Give the last commands a chance to get through, but don't wait
+	   for long on a server which doesn't read */
+	setsockopt(ssip->fd, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+		   sizeof(timeout));
+	setsockopt(ssip->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+		   sizeof(timeout));
+	ssip_command(ssip, "QUIT");
+	fcntl(ssip->fd, F_SETFL, fcntl(ssip->fd, F_GETFL) & ~O_NONBLOCK);
+	ssip_flush(ssip);
+
+	/* Closing with replies unread would reset the connection, and the
+	   server might drop what it hasn't read yet. It hangs up after
+	   QUIT. */
+	while (read(ssip->fd, buf, sizeof(buf)) > 0) ;
+
+	close(ssip->fd);
+	free(ssip->out);
+	free(ssip->pending);
+	free(ssip);
+}
+
+int ssip_fd(const struct ssip *ssip)
+{
+	return ssip->fd;
+}
+
+int ssip_want_write(const struct ssip *ssip)
+{
+	return ssip->out_len > 0;
+}
+
+/* Tell whether some commands haven't been answered yet */
+int ssip_waiting(const struct ssip *ssip)
+{
+	return ssip->pending_len > 0;
+}
+
+/*
+  ssip_flush: write as much of the pending output as the socket takes
+  without blocking. Returns -1 if the connection is broken. */
+
+int ssip_flush(struct ssip *ssip)
+{
+	ssize_t written;
+
+	while (ssip->out_len > 0) {
+		written = write(ssip->fd, ssip->out, ssip->out_len);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			LOG(1, "ERROR: Can't write to Speech Dispatcher: %s",
+			    strerror(errno));
+			return -1;
+		}
+		memmove(ssip->out, ssip->out + written,
+			ssip->out_len - written);
+		ssip->out_len -= written;
+	}
+	return 0;
+}
+
+static int out_append(struct ssip *ssip, const char *data, size_t len)
+{
+	char *new_out;
+	size_t new_size;
+
+	if (ssip->out_len + len > ssip->out_size) {
+		new_size = 2 * (ssip->out_len + len);
+		new_out = realloc(ssip->out, new_size);
+		if (new_out == NULL)
+			return -1;
+		ssip->out = new_out;
+		ssip->out_size = new_size;
+	}
+	memcpy(ssip->out + ssip->out_len, data, len);
+	ssip->out_len += len;
+	return 0;
+}
+
+/* Remember that a reply to command is on its way */
+static int pending_push(struct ssip *ssip, const char *command)
+{
+	struct ssip_pending *new_pending, *pending;
+	size_t new_size;
+
+	if (ssip->pending_head > 0
+	    && ssip->pending_head + ssip->pending_len == ssip->pending_size) {
+		memmove(ssip->pending, ssip->pending + ssip->pending_head,
+			ssip->pending_len * sizeof(*ssip->pending));
+		ssip->pending_head = 0;
+	}
+	if (ssip->pending_len == ssip->pending_size) {
+		new_size = ssip->pending_size ? 2 * ssip->pending_size : 16;
+		new_pending = realloc(ssip->pending,
+				      new_size * sizeof(*ssip->pending));
+		if (new_pending == NULL)
+			return -1;
+		ssip->pending = new_pending;
+		ssip->pending_size = new_size;
+	}
+	pending = &ssip->pending[ssip->pending_head + ssip->pending_len];
+	snprintf(pending->command, sizeof(pending->command), "%s", command);
+	pending->message = !strcmp(command, "SPEAK data")
+	    || !strncmp(command, "CHAR ", 5);
+	ssip->pending_len++;
+	return 0;
+}
+
+/*
+  ssip_command: send a command without waiting for its reply. */
+
+int ssip_command(struct ssip *ssip, const char *format, ...)
+{
+	char line[SSIP_LINE_MAX];
+	va_list args;
+	int len;
+
+	va_start(args, format);
+	len = vsnprintf(line, sizeof(line) - 2, format, args);
+	va_end(args);
+	if (len < 0 || len >= sizeof(line) - 2)
+		return -1;
+	LOG(5, "SSIP: %s", line);
+
+	if (pending_push(ssip, line))
+		return -1;
+	strcpy(line + len, "\r\n");
+	if (out_append(ssip, line, len + 2))
+		return -1;
+	return ssip_flush(ssip);
+}
+
+/*
+  ssip_speak: send a message. The data follows the SPEAK command right
+  away, the server reads it in order anyway. */
+
+int ssip_speak(struct ssip *ssip, const char *text)
+{
+	const char *line = text, *nl;
+	size_t len;
+
+	if (ssip_command(ssip, "SPEAK"))
+		return -1;
+
+	/* Data lines end with CRLF, and a leading dot is doubled so that
+	   no line looks like the terminating one */
+	while (*line != 0) {
+		nl = strchr(line, '\n');
+		len = (nl != NULL) ? nl - line : strlen(line);
+		if (len > 0 && line[len - 1] == '\r')
+			len--;
+		if (*line == '.' && out_append(ssip, ".", 1))
+			return -1;
+		if (out_append(ssip, line, len) || out_append(ssip, "\r\n", 2))
+			return -1;
+		if (nl == NULL)
+			break;
+		line = nl + 1;
+	}
+	if (out_append(ssip, ".\r\n", 3) || pending_push(ssip, "SPEAK data"))
+		return -1;
+	return ssip_flush(ssip);
+}
+
+static void handle_line(struct ssip *ssip, char *line)
+{
+	int code;
+	struct ssip_pending *pending;
+
+	if (strlen(line) < 4) {
+		LOG(1, "ERROR: Malformed SSIP reply: |%s|", line);
+		return;
+	}
+	code = strtol(line, NULL, 10);
+
+	/* Continuation lines carry the parameters */
+	if (line[3] == '-') {
+		if (ssip->n_params < 3)
+			snprintf(ssip->params[ssip->n_params++],
+				 sizeof(ssip->params[0]), "%s", line + 4);
+		return;
+	}
+
+	if (code >= 700 && code < 800) {
+		if (ssip->n_params >= 1 && ssip->callback != NULL)
+			ssip->callback(code, strtoul(ssip->params[0], NULL, 10),
+				       (ssip->n_params >= 3) ?
+				       ssip->params[2] : NULL);
+	} else if (ssip->pending_len == 0) {
+		LOG(1, "ERROR: Unexpected SSIP reply: |%s|", line);
+	} else {
+		pending = &ssip->pending[ssip->pending_head];
+		if (code >= 300)
+			LOG(1, "ERROR: SSIP command %s failed: %s",
+			    pending->command, line);
+		else
+			LOG(5, "SSIP reply to %s: %s", pending->command, line);
+		/* Report the id of a new message, or 0 if it failed */
+		if (pending->message && ssip->callback != NULL)
+			ssip->callback(SSIP_QUEUED,
+				       (code == SSIP_QUEUED
+					&& ssip->n_params >= 1) ?
+				       strtoul(ssip->params[0], NULL, 10) : 0,
+				       NULL);
+		ssip->pending_head++;
+		ssip->pending_len--;
+		if (ssip->pending_len == 0)
+			ssip->pending_head = 0;
+	}
+	ssip->n_params = 0;
+}
+
+/*
+  ssip_process: read what the server has sent, matching replies to the
+  commands and reporting events. Returns -1 if the connection is
+  broken. */
+
+int ssip_process(struct ssip *ssip)
+{
+	ssize_t bytes;
+	char *start, *end;
+
+	if (ssip_flush(ssip))
+		return -1;
+
+	while (1) {
+		bytes = read(ssip->fd, ssip->in + ssip->in_len,
+			     sizeof(ssip->in) - ssip->in_len - 1);
+		if (bytes == 0) {
+			LOG(1, "ERROR: Speech Dispatcher closed the connection");
+			return -1;
+		}
+		if (bytes < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			LOG(1, "ERROR: Can't read from Speech Dispatcher: %s",
+			    strerror(errno));
+			return -1;
+		}
+		ssip->in_len += bytes;
+		ssip->in[ssip->in_len] = 0;
+
+		start = ssip->in;
+		while ((end = strstr(start, "\r\n")) != NULL) {
+			*end = 0;
+			handle_line(ssip, start);
+			start = end + 2;
+		}
+		ssip->in_len -= start - ssip->in;
+		memmove(ssip->in, start, ssip->in_len);
+
+		/* A line this long can't be a reply of ours */
+		if (ssip->in_len == sizeof(ssip->in) - 1) {
+			LOG(1, "ERROR: SSIP line too long, discarding");
+			ssip->in_len = 0;
+		}
+	}
+}
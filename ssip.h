@@ -0,0 +1,56 @@
+/*
+ * ssip.h - Pipelined SSIP client
+ *
+ * Copyright (C) 2004, 2006, 2007 Brailcom, o.p.s.
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef SSIP_H
+#define SSIP_H
+
+#include <stddef.h>
+
+/* Events reported by Speech Dispatcher, numbered like its 7xx replies,
+   and the reply with the id of a message just queued (0 if the message
+   was refused) */
+enum ssip_event {
+	SSIP_QUEUED = 225,
+	SSIP_INDEX_MARK = 700,
+	SSIP_BEGIN = 701,
+	SSIP_END = 702,
+	SSIP_CANCEL = 703,
+	SSIP_PAUSE = 704,
+	SSIP_RESUME = 705
+};
+
+typedef void (*ssip_event_cb) (enum ssip_event event, size_t msg_id,
+			       const char *mark);
+
+struct ssip;
+
+struct ssip *ssip_open(const char *client_name, ssip_event_cb callback);
+void ssip_close(struct ssip *ssip);
+int ssip_command(struct ssip *ssip, const char *format, ...)
+    __attribute__ ((format(printf, 2, 3)));
+int ssip_speak(struct ssip *ssip, const char *text);
+int ssip_fd(const struct ssip *ssip);
+int ssip_want_write(const struct ssip *ssip);
+int ssip_waiting(const struct ssip *ssip);
+int ssip_flush(struct ssip *ssip);
+int ssip_process(struct ssip *ssip);
+
+#endif
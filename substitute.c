@@ -0,0 +1,315 @@
+/*
+ * substitute.c - Replacing strings in console text before it is said
+ *
+ * Copyright (C) 2004, 2006, 2007 Brailcom, o.p.s.
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * All the strings to replace are compiled into one Aho-Corasick
+ * automaton when the configuration is read, so the text is searched for
+ * all of them in a single pass whatever their number. Where matches
+ * overlap, the one starting first wins, and of those the longest.
+ * Index marks and prosody changes are never part of a match and are
+ * copied as they are.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+
+#include "log.h"
+#include "recode.h"
+#include "substitute.h"
+
+struct rule {
+	char *from;
+	size_t from_len;
+	char *to;
+	size_t to_len;
+	int word;		/* Only whole words are replaced */
+	int same;		/* Next rule with the same from, or -1 */
+};
+
+/* Trie node; the children of a node are a list through sibling */
+struct node {
+	int child;
+	int sibling;
+	int fail;		/* Node of the longest proper suffix */
+	int rule;		/* First rule ending here, or -1 */
+	int output;		/* Nearest node on the fail chain with a rule */
+	unsigned char byte;
+};
+
+static struct rule *rules;
+static int n_rules;
+
+static struct node *nodes;
+static int n_nodes;
+
+/* Longest rule starting at each byte of the text, and the result */
+static int *best;
+static size_t best_size;
+static char *out;
+static size_t out_size;
+
+static char *copy(const char *s, size_t len)
+{
+	char *c;
+
+	c = malloc(len + 1);
+	if (c == NULL)
+		FATAL(1, "Can't allocate substitution rule");
+	memcpy(c, s, len + 1);
+	return c;
+}
+
+static int new_node(unsigned char byte)
+{
+	struct node *new_nodes;
+
+	new_nodes = realloc(nodes, (n_nodes + 1) * sizeof(*nodes));
+	if (new_nodes == NULL)
+		FATAL(1, "Can't allocate substitution rules");
+	nodes = new_nodes;
+	nodes[n_nodes].child = -1;
+	nodes[n_nodes].sibling = -1;
+	nodes[n_nodes].fail = 0;
+	nodes[n_nodes].rule = -1;
+	nodes[n_nodes].output = -1;
+	nodes[n_nodes].byte = byte;
+	return n_nodes++;
+}
+
+static int child(int node, unsigned char byte)
+{
+	int c;
+
+	for (c = nodes[node].child; c != -1; c = nodes[c].sibling)
+		if (nodes[c].byte == byte)
+			return c;
+	return -1;
+}
+
+/*
+  substitute_add: replace from by to in all the text said, or only
+  where from is a whole word if word is set. Of several rules for the
+  same string, the first one which applies is used. */
+
+void substitute_add(const char *from, const char *to, int word)
+{
+	struct rule *new_rules;
+
+	new_rules = realloc(rules, (n_rules + 1) * sizeof(*rules));
+	if (new_rules == NULL)
+		FATAL(1, "Can't allocate substitution rules");
+	rules = new_rules;
+	rules[n_rules].from_len = strlen(from);
+	rules[n_rules].from = copy(from, rules[n_rules].from_len);
+	rules[n_rules].to_len = strlen(to);
+	rules[n_rules].to = copy(to, rules[n_rules].to_len);
+	rules[n_rules].word = word;
+	rules[n_rules].same = -1;
+	n_rules++;
+}
+
+/*
+  substitute_compile: build the automaton for the rules added so far. */
+
+void substitute_compile(void)
+{
+	int *bfs;
+	int i, r, node, next, c, head, tail, fail;
+	const unsigned char *s;
+
+	if (n_rules == 0)
+		return;
+
+	n_nodes = 0;
+	new_node(0);
+	for (r = 0; r < n_rules; r++) {
+		node = 0;
+		s = (const unsigned char *)rules[r].from;
+		for (i = 0; i < rules[r].from_len; i++) {
+			next = child(node, s[i]);
+			if (next == -1) {
+				next = new_node(s[i]);
+				nodes[next].sibling = nodes[node].child;
+				nodes[node].child = next;
+			}
+			node = next;
+		}
+		if (nodes[node].rule == -1) {
+			nodes[node].rule = r;
+		} else {
+			for (i = nodes[node].rule; rules[i].same != -1;
+			     i = rules[i].same) ;
+			rules[i].same = r;
+		}
+	}
+
+	/* Fail links, breadth first so that shorter suffixes are done */
+	bfs = malloc(n_nodes * sizeof(*bfs));
+	if (bfs == NULL)
+		FATAL(1, "Can't allocate substitution rules");
+	head = tail = 0;
+	for (c = nodes[0].child; c != -1; c = nodes[c].sibling)
+		bfs[tail++] = c;
+	while (head < tail) {
+		node = bfs[head++];
+		for (c = nodes[node].child; c != -1; c = nodes[c].sibling) {
+			fail = nodes[node].fail;
+			while (fail != 0 && child(fail, nodes[c].byte) == -1)
+				fail = nodes[fail].fail;
+			next = child(fail, nodes[c].byte);
+			nodes[c].fail = (next != -1) ? next : 0;
+			next = nodes[c].fail;
+			nodes[c].output = (nodes[next].rule != -1)
+			    ? next : nodes[next].output;
+			bfs[tail++] = c;
+		}
+	}
+	free(bfs);
+
+	LOG(3, "Compiled %d substitution rules into %d states", n_rules,
+	    n_nodes);
+}
+
+int substitute_enabled(void)
+{
+	return n_rules > 0;
+}
+
+static int word_byte(unsigned char byte)
+{
+	return isalnum(byte) || byte == '_' || byte >= 0x80;
+}
+
+static int grow(void **buf, size_t *size, size_t needed, size_t item)
+{
+	void *new_buf;
+
+	if (needed <= *size)
+		return 0;
+	needed *= 2;
+	new_buf = realloc(*buf, needed * item);
+	if (new_buf == NULL) {
+		LOG(1, "ERROR: Can't allocate substitution buffer: %s",
+		    strerror(errno));
+		return -1;
+	}
+	*buf = new_buf;
+	*size = needed;
+	return 0;
+}
+
+/* First rule for node which applies to the match ending at end */
+static int applies(int node, const unsigned char *s, size_t len,
+		   size_t end, size_t text_start)
+{
+	size_t start;
+	int r;
+
+	for (r = nodes[node].rule; r != -1; r = rules[r].same) {
+		start = end - rules[r].from_len;
+		if (!rules[r].word)
+			return r;
+		if ((start == text_start || !word_byte(s[start - 1]))
+		    && (end == len || !word_byte(s[end])))
+			return r;
+	}
+	return -1;
+}
+
+/*
+  substitute: apply the rules to text. Returns text itself if nothing
+  is replaced, otherwise a buffer valid until the next call, with its
+  length in new_len. */
+
+const char *substitute(const char *text, size_t len, size_t *new_len)
+{
+	const unsigned char *s = (const unsigned char *)text;
+	size_t i, w, start, text_start = 0;
+	int state = 0, next, node, r, found = 0;
+
+	*new_len = len;
+	if (n_rules == 0 || len == 0)
+		return text;
+	if (grow((void **)&best, &best_size, len, sizeof(*best)) == -1)
+		return text;
+
+	for (i = 0; i < len; i++) {
+		best[i] = -1;
+		if (s[i] == RECODE_MARK) {
+			/* A mark ends any match, and counts as a word
+			   boundary for what follows it */
+			while (i + 1 < len
+			       && (isdigit(s[i + 1]) || s[i + 1] == '-'))
+				best[++i] = -1;
+			if (i + 1 < len)
+				best[++i] = -1;
+			text_start = i + 1;
+			state = 0;
+			continue;
+		}
+
+		while (state != 0 && child(state, s[i]) == -1)
+			state = nodes[state].fail;
+		next = child(state, s[i]);
+		state = (next != -1) ? next : 0;
+
+		node = (nodes[state].rule != -1) ? state : nodes[state].output;
+		for (; node != -1; node = nodes[node].output) {
+			r = applies(node, s, len, i + 1, text_start);
+			if (r == -1)
+				continue;
+			start = i + 1 - rules[r].from_len;
+			if (best[start] == -1
+			    || rules[best[start]].from_len < rules[r].from_len)
+				best[start] = r;
+			found = 1;
+		}
+	}
+	if (!found)
+		return text;
+
+	w = 0;
+	for (i = 0; i < len;) {
+		r = best[i];
+		if (r == -1) {
+			if (grow((void **)&out, &out_size, w + 1, 1) == -1)
+				return text;
+			out[w++] = text[i++];
+			continue;
+		}
+		if (grow((void **)&out, &out_size, w + rules[r].to_len, 1)
+		    == -1)
+			return text;
+		memcpy(out + w, rules[r].to, rules[r].to_len);
+		w += rules[r].to_len;
+		i += rules[r].from_len;
+	}
+	LOG(5, "substituted: |%.*s|", (int)w, out);
+	*new_len = w;
+	return out;
+}
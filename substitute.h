@@ -0,0 +1,32 @@
+/*
+ * substitute.h - Replacing strings in console text before it is said
+ *
+ * Copyright (C) 2004, 2006, 2007 Brailcom, o.p.s.
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef SUBSTITUTE_H
+#define SUBSTITUTE_H
+
+#include <stddef.h>
+
+void substitute_add(const char *from, const char *to, int word);
+void substitute_compile(void);
+int substitute_enabled(void);
+const char *substitute(const char *text, size_t len, size_t *new_len);
+
+#endif